@@ -0,0 +1,136 @@
+#ifndef BITPACKING_H
+#define BITPACKING_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Compression of lists of point indices. The indices of an octant are ascending so they are
+// stored as deltas bit-packed by blocks of 128 values. A block is
+// - the first value (uint32)
+// - the bit width w of the block (uint8)
+// - the n-1 following values as (v[k] - v[k-1] - 1) on w bits each, in a little-endian bit stream
+// A block that is not strictly ascending is stored raw (w = BITPACK_RAW). The decoder reads 8
+// bytes at a time so a buffer must be followed by BITPACK_PADDING readable bytes.
+
+const uint32_t BITPACK_BLOCK = 128;
+const uint8_t BITPACK_RAW = 255;
+const size_t BITPACK_PADDING = 8;
+
+inline void bitpack_encode(const uint32_t* in, size_t n, std::vector<uint8_t>& out)
+{
+  for (size_t start = 0 ; start < n ; start += BITPACK_BLOCK)
+  {
+    uint32_t m = (uint32_t)std::min<size_t>(BITPACK_BLOCK, n - start);
+    const uint32_t* v = in + start;
+
+    bool ascending = true;
+    uint32_t max = 0;
+    for (uint32_t k = 1 ; k < m ; k++)
+    {
+      if (v[k] <= v[k-1]) { ascending = false; break; }
+      max |= v[k] - v[k-1] - 1;
+    }
+
+    uint8_t width = 0;
+    while (width < 32 && (max >> width) != 0) width++;
+    if (!ascending) width = BITPACK_RAW;
+
+    size_t pos = out.size();
+    out.resize(pos + sizeof(uint32_t) + 1);
+    std::memcpy(&out[pos], &v[0], sizeof(uint32_t));
+    out[pos + sizeof(uint32_t)] = width;
+
+    if (width == BITPACK_RAW)
+    {
+      pos = out.size();
+      out.resize(pos + (m - 1) * sizeof(uint32_t));
+      if (m > 1) std::memcpy(&out[pos], &v[1], (m - 1) * sizeof(uint32_t));
+      continue;
+    }
+
+    uint64_t buffer = 0;
+    int bits = 0;
+    for (uint32_t k = 1 ; k < m ; k++)
+    {
+      buffer |= (uint64_t)(v[k] - v[k-1] - 1) << bits;
+      bits += width;
+      while (bits >= 8)
+      {
+        out.push_back(buffer & 0xFF);
+        buffer >>= 8;
+        bits -= 8;
+      }
+    }
+
+    if (bits > 0) out.push_back(buffer & 0xFF);
+  }
+}
+
+// Unpacks n values of W bits. W is a template parameter so the loop has no data dependent
+// branch and can be vectorized by the compiler.
+template<int W>
+inline void bitpack_unpack(const uint8_t* in, uint32_t n, uint32_t* out)
+{
+  const uint64_t mask = (W == 0) ? 0 : ((uint64_t)1 << W) - 1;
+  for (uint32_t i = 0 ; i < n ; i++)
+  {
+    uint32_t bit = i * W;
+    uint64_t word;
+    std::memcpy(&word, in + (bit >> 3), sizeof(word));
+    out[i] = (uint32_t)((word >> (bit & 7)) & mask);
+  }
+}
+
+typedef void (*BitUnpacker)(const uint8_t*, uint32_t, uint32_t*);
+
+template<size_t... W>
+inline const BitUnpacker* bitpack_unpackers(std::index_sequence<W...>)
+{
+  static const BitUnpacker table[] = { &bitpack_unpack<W>... };
+  return table;
+}
+
+// Decodes n values from a buffer of size bytes (padding excluded). Returns the number of bytes
+// read or 0 if the buffer is corrupted.
+inline size_t bitpack_decode(const uint8_t* in, size_t size, size_t n, uint32_t* out)
+{
+  static const BitUnpacker* unpack = bitpack_unpackers(std::make_index_sequence<33>());
+
+  const uint8_t* start = in;
+  const uint8_t* end = in + size;
+  uint32_t deltas[BITPACK_BLOCK];
+
+  for (size_t first = 0 ; first < n ; first += BITPACK_BLOCK)
+  {
+    uint32_t m = (uint32_t)std::min<size_t>(BITPACK_BLOCK, n - first);
+    uint32_t* v = out + first;
+
+    if (end - in < (ptrdiff_t)sizeof(uint32_t) + 1) return 0;
+    std::memcpy(&v[0], in, sizeof(uint32_t));
+    uint8_t width = in[sizeof(uint32_t)];
+    in += sizeof(uint32_t) + 1;
+
+    size_t bytes = (width == BITPACK_RAW) ? (m - 1) * sizeof(uint32_t) : ((m - 1) * width + 7) / 8;
+    if ((width > 32 && width != BITPACK_RAW) || end - in < (ptrdiff_t)bytes) return 0;
+
+    if (width == BITPACK_RAW)
+    {
+      if (m > 1) std::memcpy(&v[1], in, (m - 1) * sizeof(uint32_t));
+      in += bytes;
+      continue;
+    }
+
+    unpack[width](in, m - 1, deltas);
+    in += bytes;
+
+    for (uint32_t k = 1 ; k < m ; k++) v[k] = v[k-1] + deltas[k-1] + 1;
+  }
+
+  return in - start;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BUDGETCONTROLLER_H
+#define BUDGETCONTROLLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Number of points rendered per frame adjusted from the measured frame time to hold a target
+// frame rate while the camera moves. After each frame the budget is scaled by the ratio of the
+// target to the measured time. The change is damped to absorb the noise of the measurements and
+// the budget is increased only if it actually limited the number of points rendered.
+//
+// Once the camera stops the frame is refined progressively: the budget of each new frame is
+// doubled, so the total work of the refinement remains proportional to the last frame, up to
+// get_idle_max(), i.e. as many points as can be rendered in the idle target time at the measured
+// rate. A user input during the refinement thus waits at most about this time.
+class BudgetController
+{
+public:
+  BudgetController()
+  {
+    target = 1.0/30.0;
+    idle_target = 0.25;
+    budget = 300000;
+  };
+
+  uint32_t get() const { return (uint32_t)budget; };
+  uint32_t get_next(uint32_t current) const { return (uint32_t)std::min(2.0 * current, (double)get_idle_max()); };
+  uint32_t get_idle_max() const { return (uint32_t)std::min(budget * idle_target / target, MAX_BUDGET); };
+  double get_idle_target() const { return idle_target; };
+  double get_fps() const { return 1.0/target; };
+
+  // Interactive target frame rate, from 5 to 120 fps
+  void set_fps(double fps) { target = 1.0/std::clamp(fps, 5.0, 120.0); };
+
+  void update(double seconds, uint64_t rendered)
+  {
+    if (seconds <= 0) return;
+
+    double ratio = std::clamp(target / seconds, 0.5, 1.5);
+    bool limited = rendered >= 0.9 * budget;
+    if (ratio > 1 && !limited) return;
+
+    budget = std::clamp(budget * std::sqrt(ratio), MIN_BUDGET, MAX_BUDGET);
+  };
+
+private:
+  static constexpr double MIN_BUDGET = 50000;
+  static constexpr double MAX_BUDGET = 100000000;
+
+  double target;
+  double idle_target;
+  double budget;
+};
+
+#endif
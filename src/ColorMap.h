@@ -0,0 +1,112 @@
+#ifndef COLORMAP_H
+#define COLORMAP_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "PointCloud.h"
+
+enum Attribute{Z, I, RGB, CLASS};
+const int NATTRIBUTES = 4;
+
+inline std::vector<uint32_t> pack_palette(const std::vector<std::array<unsigned char, 3>>& palette)
+{
+  std::vector<uint32_t> lut(palette.size());
+  for (size_t i = 0 ; i < palette.size() ; i++) lut[i] = rgba(palette[i][0], palette[i][1], palette[i][2]);
+  return lut;
+}
+
+// Parameters of the colouring of an attribute. A value v is coloured with
+// lut[min((clamp(v, min, max) - min) * factor, nlut - 1)] with factor = (nlut - 1) / (max - min).
+// RGB colours are not scaled: the packed colours of the point cloud are used as is.
+struct ColorScale
+{
+  double min;
+  double max;
+  double factor;
+  const uint32_t* lut;
+  int nlut;
+
+  bool operator==(const ColorScale& o) const { return min == o.min && max == o.max && lut == o.lut && nlut == o.nlut; };
+  bool operator!=(const ColorScale& o) const { return !(*this == o); };
+};
+
+// Computes the colours of count points starting at 'start' in the order 'order' (or in the order
+// of the point cloud if nullptr). The kernel is specialized for each attribute. The points are
+// processed by blocks: the values are gathered in a contiguous buffer and then converted into
+// colours in a loop without branch that the compiler can vectorize.
+template<Attribute A>
+void colorize(const PointCloud& points, const uint32_t* order, uint32_t start, uint32_t count, const ColorScale& scale, uint32_t* out)
+{
+  const uint32_t BLOCK = 256;
+  float values[BLOCK];
+  int32_t bins[BLOCK];
+
+  const float vmin = (float)scale.min;
+  const float vmax = (float)scale.max;
+  const float factor = (float)scale.factor;
+  const int32_t last = scale.nlut - 1;
+  const uint32_t* lut = scale.lut;
+
+  for (uint32_t first = 0 ; first < count ; first += BLOCK)
+  {
+    uint32_t m = std::min(BLOCK, count - first);
+    uint32_t* c = out + first;
+
+    if constexpr (A == Attribute::RGB)
+    {
+      if (order == nullptr)
+      {
+        std::copy(points.rgba + start + first, points.rgba + start + first + m, c);
+      }
+      else
+      {
+        for (uint32_t k = 0 ; k < m ; k++) c[k] = points.rgba[order[start + first + k]];
+      }
+    }
+    else if constexpr (A == Attribute::CLASS)
+    {
+      for (uint32_t k = 0 ; k < m ; k++)
+      {
+        uint32_t i = (order) ? order[start + first + k] : start + first + k;
+        bins[k] = points.classification[i];
+      }
+
+      for (uint32_t k = 0 ; k < m ; k++) bins[k] = std::clamp(bins[k], 0, last);
+      for (uint32_t k = 0 ; k < m ; k++) c[k] = lut[bins[k]];
+    }
+    else
+    {
+      for (uint32_t k = 0 ; k < m ; k++)
+      {
+        uint32_t i = (order) ? order[start + first + k] : start + first + k;
+        if constexpr (A == Attribute::Z) values[k] = (float)points.get_z(i);
+        else values[k] = (float)points.intensity[i];
+      }
+
+      for (uint32_t k = 0 ; k < m ; k++)
+      {
+        float v = (std::clamp(values[k], vmin, vmax) - vmin) * factor;
+        bins[k] = std::min((int32_t)v, last);
+      }
+
+      for (uint32_t k = 0 ; k < m ; k++) c[k] = lut[bins[k]];
+    }
+  }
+}
+
+inline void colorize(Attribute attr, const PointCloud& points, const uint32_t* order, uint32_t start, uint32_t count, const ColorScale& scale, uint32_t* out)
+{
+  switch (attr)
+  {
+    case Attribute::Z:     colorize<Attribute::Z>(points, order, start, count, scale, out); break;
+    case Attribute::I:     colorize<Attribute::I>(points, order, start, count, scale, out); break;
+    case Attribute::RGB:   colorize<Attribute::RGB>(points, order, start, count, scale, out); break;
+    case Attribute::CLASS: colorize<Attribute::CLASS>(points, order, start, count, scale, out); break;
+  }
+}
+
+#endif
@@ -0,0 +1,357 @@
+#include "Edl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The depth is converted back to the distance to the camera for the near and far planes below
+const float EDL_ZNEAR = 1;
+const float EDL_ZFAR = 10000;
+const float EDL_STRENGTH = 10;
+
+static inline float camera_distance(float depth)
+{
+  float zNDC = 2.0f * depth - 1.0f;
+  return (2.0f * EDL_ZNEAR * EDL_ZFAR) / (EDL_ZFAR + EDL_ZNEAR - zNDC * (EDL_ZFAR - EDL_ZNEAR));
+}
+
+// log2(x) for x > 0. x = 2^e * m with m in [sqrt(2)/2, sqrt(2)[ and log2(m) is computed with the
+// series of atanh(s), s = (m-1)/(m+1), |s| < 0.172. The error is below the precision of a float.
+static inline float approx_log2(float x)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  int32_t e = (int32_t)((bits >> 23) & 0xFF) - 127;
+  bits = (bits & 0x007FFFFF) | 0x3F800000;
+  float m;
+  std::memcpy(&m, &bits, sizeof(m));
+
+  float shift = (m > 1.41421356f) ? 1.0f : 0.0f;
+  m = (m > 1.41421356f) ? m * 0.5f : m;
+
+  float s = (m - 1.0f) / (m + 1.0f);
+  float s2 = s * s;
+  float p = 1.0f/9.0f;
+  p = p * s2 + 1.0f/7.0f;
+  p = p * s2 + 1.0f/5.0f;
+  p = p * s2 + 1.0f/3.0f;
+  p = p * s2 + 1.0f;
+  return (float)e + shift + 2.8853900817779268f * s * p; // 2/ln(2)
+}
+
+// 2^t for t in [-100, 100]. t = i + f with i integer and f in [-0.5, 0.5]. 2^f is a polynomial
+// and 2^i is added to the exponent.
+static inline float approx_exp2(float t)
+{
+  float i = std::floor(t + 0.5f);
+  float f = (t - i) * 0.69314718f; // 2^f = e^(f ln2)
+  float p = 1.0f/720.0f;
+  p = p * f + 1.0f/120.0f;
+  p = p * f + 1.0f/24.0f;
+  p = p * f + 1.0f/6.0f;
+  p = p * f + 0.5f;
+  p = p * f + 1.0f;
+  p = p * f + 1.0f;
+
+  uint32_t bits;
+  std::memcpy(&bits, &p, sizeof(bits));
+  bits += (uint32_t)((int32_t)i << 23);
+  std::memcpy(&p, &bits, sizeof(p));
+  return p;
+}
+
+#if defined(__SSE2__)
+// Same computations on 4 floats
+static inline __m128 camera_distance4(__m128 depth)
+{
+  __m128 zNDC = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(2.0f), depth), _mm_set1_ps(1.0f));
+  __m128 den = _mm_sub_ps(_mm_set1_ps(EDL_ZFAR + EDL_ZNEAR), _mm_mul_ps(zNDC, _mm_set1_ps(EDL_ZFAR - EDL_ZNEAR)));
+  return _mm_div_ps(_mm_set1_ps(2.0f * EDL_ZNEAR * EDL_ZFAR), den);
+}
+
+static inline __m128 approx_log2_4(__m128 x)
+{
+  __m128i bits = _mm_castps_si128(x);
+  __m128i e = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xFF)), _mm_set1_epi32(127));
+  __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+
+  __m128 mask = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+  __m128 shift = _mm_and_ps(mask, _mm_set1_ps(1.0f));
+  m = _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(m, _mm_set1_ps(0.5f))), _mm_andnot_ps(mask, m));
+
+  __m128 s = _mm_div_ps(_mm_sub_ps(m, _mm_set1_ps(1.0f)), _mm_add_ps(m, _mm_set1_ps(1.0f)));
+  __m128 s2 = _mm_mul_ps(s, s);
+  __m128 p = _mm_set1_ps(1.0f/9.0f);
+  p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/7.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/5.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/3.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f));
+  __m128 l = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.8853900817779268f), s), p);
+  return _mm_add_ps(_mm_add_ps(_mm_cvtepi32_ps(e), shift), l);
+}
+
+static inline __m128 approx_exp2_4(__m128 t)
+{
+  // t >= -100 so the truncation of t + 128.5 is floor(t + 0.5) + 128
+  __m128i i = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(t, _mm_set1_ps(128.5f))), _mm_set1_epi32(128));
+  __m128 f = _mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(i)), _mm_set1_ps(0.69314718f));
+  __m128 p = _mm_set1_ps(1.0f/720.0f);
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f/120.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f/24.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f/6.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.5f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+  return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(i, 23)));
+}
+#endif
+
+Edl::Edl(int nthreads)
+{
+  width = 0;
+  height = 0;
+  job = 0;
+  phase = 0;
+  pending = 0;
+  stop = false;
+  this->nthreads = std::max(nthreads, 1);
+
+  for (int i = 1 ; i < this->nthreads ; i++)
+    workers.emplace_back(&Edl::work, this, i);
+}
+
+Edl::~Edl()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+void Edl::resize(int width, int height)
+{
+  if (width == this->width && height == this->height) return;
+
+  this->width = width;
+  this->height = height;
+  size_t n = (size_t)width * height;
+  depth_buffer.resize(n);
+  color_buffer.resize(n * 3);
+  logd.resize(n);
+  shades.resize(n);
+}
+
+void Edl::shade()
+{
+  if (width == 0 || height == 0) return;
+
+  // The shading of a row needs the log distances of the rows above and below. They are all
+  // computed before the shading starts.
+  run(0);
+  run(1);
+}
+
+// Processes a phase with all the threads, each one doing a band of rows
+void Edl::run(int phase)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->phase = phase;
+    this->pending = workers.size();
+    job++;
+  }
+  cv.notify_all();
+
+  process(phase, 0, height / nthreads);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this]() { return pending == 0; });
+}
+
+void Edl::work(int id)
+{
+  uint64_t last = 0;
+
+  while (true)
+  {
+    int phase;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this, last]() { return stop || job != last; });
+      if (stop) return;
+      last = job;
+      phase = this->phase;
+    }
+
+    process(phase, (int64_t)height * id / nthreads, (int64_t)height * (id + 1) / nthreads);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0) done.notify_one();
+  }
+}
+
+void Edl::process(int phase, int first_row, int last_row)
+{
+  const float background = approx_log2(camera_distance(1.0f));
+  const float factor = -300.0f * EDL_STRENGTH * 1.44269504f / 4.0f; // -300 * strength / ln(2) / 4
+
+  if (phase == 0)
+  {
+    const float* depth = depth_buffer.data() + (size_t)first_row * width;
+    float* out = logd.data() + (size_t)first_row * width;
+    size_t n = (size_t)(last_row - first_row) * width;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for ( ; i + 4 <= n ; i += 4) _mm_storeu_ps(out + i, approx_log2_4(camera_distance4(_mm_loadu_ps(depth + i))));
+#endif
+    for ( ; i < n ; i++) out[i] = approx_log2(camera_distance(depth[i]));
+    return;
+  }
+
+  for (int y = first_row ; y < last_row ; y++)
+  {
+    const float* c = logd.data() + (size_t)y * width;
+    const float* u = (y > 0) ? c - width : nullptr;
+    const float* d = (y < height - 1) ? c + width : nullptr;
+    float* s = shades.data() + (size_t)y * width;
+    uint8_t* rgb = color_buffer.data() + (size_t)y * width * 3;
+
+    // Sum of the differences with the 4 neighbours, in the same order as the reference (left, up,
+    // down, right). Neighbours out of the frame are ignored. The first and last pixels of the row
+    // are done apart so the inner loop has no branch.
+    auto scalar = [&](int x)
+    {
+      float sum = (x > 0) ? c[x] - c[x-1] : 0.0f;
+      if (u) sum += c[x] - u[x];
+      if (d) sum += c[x] - d[x];
+      if (x < width - 1) sum += c[x] - c[x+1];
+
+      float t = std::clamp(sum * factor, -100.0f, 9.0f);
+      float shade = 1.0f - std::min(approx_exp2(t), 255.0f) / 255.0f;
+      s[x] = (c[x] == background) ? 1.0f : shade;
+    };
+
+    int x = 1;
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    for ( ; x + 4 < width ; x += 4)
+    {
+      __m128 cx = _mm_loadu_ps(c + x);
+      __m128 sum = _mm_sub_ps(cx, _mm_loadu_ps(c + x - 1));
+      sum = _mm_add_ps(sum, (u) ? _mm_sub_ps(cx, _mm_loadu_ps(u + x)) : zero);
+      sum = _mm_add_ps(sum, (d) ? _mm_sub_ps(cx, _mm_loadu_ps(d + x)) : zero);
+      sum = _mm_add_ps(sum, _mm_sub_ps(cx, _mm_loadu_ps(c + x + 1)));
+
+      __m128 t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(sum, _mm_set1_ps(factor)), _mm_set1_ps(-100.0f)), _mm_set1_ps(9.0f));
+      __m128 e = _mm_min_ps(approx_exp2_4(t), _mm_set1_ps(255.0f));
+      __m128 shade = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_div_ps(e, _mm_set1_ps(255.0f)));
+      __m128 mask = _mm_cmpeq_ps(cx, _mm_set1_ps(background));
+      shade = _mm_or_ps(_mm_and_ps(mask, _mm_set1_ps(1.0f)), _mm_andnot_ps(mask, shade));
+      _mm_storeu_ps(s + x, shade);
+    }
+#endif
+    scalar(0);
+    for ( ; x < width ; x++) scalar(x);
+
+    // Colours multiplied by the shade. 16 pixels are 48 bytes i.e. 3 vectors of 16 channels.
+    x = 0;
+#if defined(__SSE2__)
+    for ( ; x + 16 <= width ; x += 16)
+    {
+      __m128 shade[12];
+      for (int k = 0 ; k < 4 ; k++)
+      {
+        __m128 v = _mm_loadu_ps(s + x + 4*k);
+        shade[3*k]   = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 0, 0));
+        shade[3*k+1] = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 1, 1));
+        shade[3*k+2] = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 2));
+      }
+
+      for (int k = 0 ; k < 3 ; k++)
+      {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(rgb + 3*x + 16*k));
+        __m128i lo = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+        __m128i hi = _mm_unpackhi_epi8(bytes, _mm_setzero_si128());
+        __m128i w0 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, _mm_setzero_si128())), shade[4*k]));
+        __m128i w1 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, _mm_setzero_si128())), shade[4*k+1]));
+        __m128i w2 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, _mm_setzero_si128())), shade[4*k+2]));
+        __m128i w3 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, _mm_setzero_si128())), shade[4*k+3]));
+        bytes = _mm_packus_epi16(_mm_packs_epi32(w0, w1), _mm_packs_epi32(w2, w3));
+        _mm_storeu_si128((__m128i*)(rgb + 3*x + 16*k), bytes);
+      }
+    }
+#endif
+    for ( ; x < width ; x++)
+    {
+      rgb[3*x]   = (uint8_t)(rgb[3*x]   * s[x]);
+      rgb[3*x+1] = (uint8_t)(rgb[3*x+1] * s[x]);
+      rgb[3*x+2] = (uint8_t)(rgb[3*x+2] * s[x]);
+    }
+  }
+}
+
+void Edl::shade_reference(const float* depth, uint8_t* colorBuffer, int width, int height)
+{
+  const float zNear = EDL_ZNEAR;
+  const float zFar = EDL_ZFAR;
+  const float logzFar = std::log2(zFar);
+
+  std::vector<float> worldLogDistances(width * height);
+  for (int i = 0; i < width * height; ++i)
+  {
+    float z = depth[i];           // Depth value from the depth buffer
+    float zNDC = 2.0f * z - 1.0f; // Convert depth value to Normalized Device Coordinate (NDC)
+    float zCamera = (2.0f * zNear * zFar) / (zFar + zNear - zNDC * (zFar - zNear)); // Convert NDC to camera space Z (real-world distance)
+    worldLogDistances[i] = std::log2(zCamera);  // Store the real-world log distance
+  }
+
+  // Define the 4 possible neighbor offsets in a 2D grid
+  std::vector<std::pair<int, int>> neighbors = {
+             {-1, 0},
+    { 0, -1},         { 0, 1},
+             { 1, 0},
+  };
+
+  // Iterate over each pixel to shade the rendering
+  float edlStrength = EDL_STRENGTH;
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      int idx = y * width + x;
+      float wld = worldLogDistances[idx];
+
+      if (wld == logzFar) { continue; }
+
+      // Find the maximum log depth among neighbors
+      float maxLogDepth = std::max(0.0f, wld);
+
+      // Compute the response for the current pixel
+      float sum = 0.0f;
+      for (const auto& offset : neighbors)
+      {
+        int nx = x + offset.first;
+        int ny = y + offset.second;
+        if (nx >= 0 && nx < width && ny >= 0 && ny < height)
+        {
+          int nIdx = ny * width + nx;
+          sum += maxLogDepth - worldLogDistances[nIdx];
+        }
+      }
+
+      float response = sum/4;
+      float shade = std::exp(-response * 300.0 * edlStrength);
+      shade = 1-std::clamp(shade, 0.0f, 255.0f)/255.0f;
+
+      colorBuffer[idx * 3] *= shade;
+      colorBuffer[idx * 3 + 1] *= shade;
+      colorBuffer[idx * 3 + 2] *= shade;
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef EDL_H
+#define EDL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Eye-dome lighting of a rendered frame. The depth and colour buffers read from OpenGL are kept
+// from a frame to the next and only reallocated when the size of the window changes. The rows
+// are shaded by a pool of persistent threads. The logarithms and exponentials are computed with
+// polynomial approximations, 4 pixels at a time with SSE2 (scalar code on other platforms).
+//
+// Usage: resize(), fill depth() and color() (RGB, rows packed), shade() and then draw color().
+class Edl
+{
+public:
+  Edl(int nthreads = 1);
+  ~Edl();
+
+  void resize(int width, int height);
+  float* depth() { return depth_buffer.data(); };
+  uint8_t* color() { return color_buffer.data(); };
+  void shade();
+
+  // Straightforward implementation with std::log2 and std::exp on a single thread. Reference for
+  // the validation of shade().
+  static void shade_reference(const float* depth, uint8_t* color, int width, int height);
+
+private:
+  void run(int phase);
+  void process(int phase, int first_row, int last_row);
+  void work(int id);
+
+  int width;
+  int height;
+  std::vector<float> depth_buffer;
+  std::vector<uint8_t> color_buffer;
+  std::vector<float> logd;
+  std::vector<float> shades;
+
+  // Each phase is processed by all the threads (the calling thread included), a band of rows each
+  int nthreads;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable done;
+  uint64_t job;
+  int phase;
+  int pending;
+  bool stop;
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include "ExternalBuilder.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "Messages.h"
+#include "Occupancy.h"
+
+// Points read or spilled at once
+static const size_t BATCH = 65536;
+
+// Memory needed to index a point in memory: the record, the coordinates, the index and the order
+static const size_t BYTES_PER_POINT = 80;
+
+ExternalBuilder::ExternalBuilder(const std::string& las, const std::string& tmpdir, size_t memory, bool verbose) : las(las)
+{
+  this->tmpdir = tmpdir;
+  this->memory = memory;
+  this->verbose = verbose;
+  this->npoints = this->las.get_npoints();
+  this->written = 0;
+  this->spills = 0;
+
+  // The frame must be the one of the octree built in memory, i.e. the bounding box of the points
+  // themselves. Points outside of a stale header bounding box would be clamped in the cells of
+  // its boundaries.
+  this->las.read_bbox(bbox);
+  frame = Octree(bbox, npoints);
+
+  data = HnofData();
+  for (int k = 0 ; k < 3 ; k++)
+  {
+    data.scale[k] = this->las.get_scale()[k];
+    data.offset[k] = this->las.get_offset()[k];
+  }
+  std::copy(bbox, bbox + 6, data.bbox);
+}
+
+std::string ExternalBuilder::bucket_path(const Key& key) const
+{
+  return tmpdir + "/hnof_" + std::to_string(key.d) + "_" + std::to_string(key.x) + "_" + std::to_string(key.y) + "_" + std::to_string(key.z) + ".bin";
+}
+
+void ExternalBuilder::write(const std::string& hnof)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  out.open(hnof, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Failed to open file for writing: " + hnof);
+
+  HnofHeader header = {};
+  std::copy(HNOF_SIGNATURE, HNOF_SIGNATURE + 4, header.signature);
+  header.version_major = HNOF_VERSION_MAJOR;
+  header.version_minor = HNOF_VERSION_MINOR;
+  header.header_size = sizeof(HnofHeader);
+  header.xmin = frame.get_xmin();
+  header.ymin = frame.get_ymin();
+  header.zmin = frame.get_zmin();
+  header.xmax = frame.get_xmax();
+  header.ymax = frame.get_ymax();
+  header.zmax = frame.get_zmax();
+  header.grid_size = frame.get_gridsize();
+  header.max_depth = frame.get_max_depth();
+  header.npoints = npoints;
+  header.flags = HNOF_DATA | HNOF_ORDERLESS;
+
+  // The sections of the points have a known size. The node table is only known at the end.
+  header.data_offset = hnof_align(sizeof(HnofHeader));
+  uint64_t next = header.data_offset + sizeof(HnofData);
+  data.xyz_offset = hnof_align(next);
+  next = data.xyz_offset + npoints * 3 * sizeof(int32_t);
+  if (las.has_rgb())
+  {
+    data.rgb_offset = hnof_align(next);
+    next = data.rgb_offset + npoints * 3 * sizeof(uint16_t);
+  }
+  data.intensity_offset = hnof_align(next);
+  next = data.intensity_offset + npoints * sizeof(uint16_t);
+  data.classification_offset = hnof_align(next);
+  next = data.classification_offset + npoints * sizeof(uint8_t);
+
+  try
+  {
+    uint64_t read = 0;
+    Source source = [this, &read](LasRecord* out, size_t n) -> size_t
+    {
+      n = std::min<uint64_t>(n, npoints - read);
+      las.read(read, n, out);
+      read += n;
+      return n;
+    };
+
+    process(Key::root(), source, npoints);
+  }
+  catch (...)
+  {
+    for (const auto& path : temporary) std::remove(path.c_str());
+    out.close();
+    std::remove(hnof.c_str());
+    throw;
+  }
+
+  if (written != npoints)
+  {
+    out.close();
+    std::remove(hnof.c_str());
+    throw std::runtime_error("Fewer points than declared in the header of the LAS file");
+  }
+
+  header.nnodes = nodes.size();
+  header.node_offset = hnof_align(next);
+
+  const char padding[HNOF_ALIGNMENT] = {0};
+  out.seekp(next);
+  out.write(padding, header.node_offset - next);
+  out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(HnofNode));
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(HnofHeader));
+  out.seekp(header.data_offset);
+  out.write(reinterpret_cast<const char*>(&data), sizeof(HnofData));
+
+  if (!out)
+    throw std::runtime_error("Failed to write file: " + hnof);
+
+  out.close();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> duration = end - start;
+  if (verbose) post_message("Indexation: %.1lf seconds (%.1lfM pts/s, %d octants spilled to disk)\n", duration.count(), npoints/duration.count()/1000000, spills);
+}
+
+void ExternalBuilder::process(const Key& key, const Source& source, uint64_t count)
+{
+  const double* scale = data.scale;
+  const double* offset = data.offset;
+
+  // Last level: every point is accepted
+  if (key.d >= frame.get_max_depth())
+  {
+    uint64_t first = written;
+    std::vector<LasRecord> buffer(BATCH);
+    size_t n;
+    while ((n = source(buffer.data(), BATCH)) > 0) append(buffer.data(), n);
+    nodes.push_back({key.d, key.x, key.y, key.z, first, written - first});
+    return;
+  }
+
+  // The subtree fits in memory
+  if (count * BYTES_PER_POINT <= memory)
+  {
+    std::vector<LasRecord> points(count);
+    size_t n = 0, k;
+    while (n < count && (k = source(&points[n], count - n)) > 0) n += k;
+    points.resize(n);
+
+    std::vector<double> x(n), y(n), z(n);
+    for (size_t i = 0 ; i < n ; i++)
+    {
+      x[i] = points[i].X * scale[0] + offset[0];
+      y[i] = points[i].Y * scale[1] + offset[1];
+      z[i] = points[i].Z * scale[2] + offset[2];
+    }
+
+    Octree tree(bbox, npoints);
+    tree.build_subtree(x.data(), y.data(), z.data(), n, key.d);
+
+    const uint32_t* order = tree.get_order();
+    std::vector<LasRecord> sorted(n);
+    for (size_t i = 0 ; i < n ; i++) sorted[i] = points[order[i]];
+
+    uint64_t first = written;
+    append(sorted.data(), n);
+
+    std::vector<HnofNode> subtree;
+    for (const auto& node : tree.get_hierarchy())
+      subtree.push_back({node.key.d, node.key.x, node.key.y, node.key.z, first + node.offset, node.count});
+    std::sort(subtree.begin(), subtree.end(), [](const HnofNode& a, const HnofNode& b) { return a.offset < b.offset; });
+    nodes.insert(nodes.end(), subtree.begin(), subtree.end());
+    return;
+  }
+
+  // Too many points: the octant keeps the points of the free cells and the others are spilled
+  spills++;
+
+  int grid_size = frame.get_gridsize();
+  Occupancy occupancy(grid_size*grid_size*grid_size);
+  std::vector<LasRecord> kept;
+
+  std::array<Key, 8> children = key.get_children();
+  std::array<FILE*, 8> files;
+  std::array<uint64_t, 8> counts;
+  std::array<std::vector<LasRecord>, 8> buffers;
+  files.fill(nullptr);
+  counts.fill(0);
+
+  auto flush = [&](int c)
+  {
+    if (files[c] == nullptr)
+    {
+      std::string path = bucket_path(children[c]);
+      files[c] = std::fopen(path.c_str(), "wb");
+      if (files[c] == nullptr) throw std::runtime_error("Failed to open temporary file: " + path);
+      temporary.push_back(path);
+    }
+
+    if (std::fwrite(buffers[c].data(), sizeof(LasRecord), buffers[c].size(), files[c]) != buffers[c].size())
+      throw std::runtime_error("Failed to write temporary file: " + bucket_path(children[c]));
+
+    buffers[c].clear();
+  };
+
+  std::vector<LasRecord> buffer(BATCH);
+  size_t n;
+  while ((n = source(buffer.data(), BATCH)) > 0)
+  {
+    for (size_t i = 0 ; i < n ; i++)
+    {
+      const LasRecord& r = buffer[i];
+      double x = r.X * scale[0] + offset[0];
+      double y = r.Y * scale[1] + offset[1];
+      double z = r.Z * scale[2] + offset[2];
+
+      if (occupancy.insert(frame.get_cell(x, y, z, key)))
+      {
+        kept.push_back(r);
+        continue;
+      }
+
+      Key child = frame.get_key(x, y, z, key.d + 1);
+      int c = (child.x & 1) | ((child.y & 1) << 1) | ((child.z & 1) << 2);
+      buffers[c].push_back(r);
+      counts[c]++;
+      if (buffers[c].size() == BATCH) flush(c);
+    }
+  }
+
+  for (int c = 0 ; c < 8 ; c++)
+  {
+    if (!buffers[c].empty()) flush(c);
+    if (files[c]) std::fclose(files[c]);
+    std::vector<LasRecord>().swap(buffers[c]);
+  }
+
+  uint64_t first = written;
+  append(kept.data(), kept.size());
+  nodes.push_back({key.d, key.x, key.y, key.z, first, kept.size()});
+  std::vector<LasRecord>().swap(kept);
+  std::vector<LasRecord>().swap(buffer);
+
+  for (int c = 0 ; c < 8 ; c++)
+  {
+    if (counts[c] == 0) continue;
+
+    std::string path = bucket_path(children[c]);
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (f == nullptr) throw std::runtime_error("Failed to open temporary file: " + path);
+
+    Source bucket = [f](LasRecord* out, size_t n) { return std::fread(out, sizeof(LasRecord), n, f); };
+
+    try
+    {
+      process(children[c], bucket, counts[c]);
+    }
+    catch (...)
+    {
+      std::fclose(f);
+      throw;
+    }
+
+    std::fclose(f);
+    std::remove(path.c_str());
+    temporary.erase(std::find(temporary.begin(), temporary.end(), path));
+  }
+}
+
+// Appends points at the end of each section of the file
+void ExternalBuilder::append(const LasRecord* points, size_t n)
+{
+  if (n == 0) return;
+
+  if (written + n > npoints)
+    throw std::runtime_error("More points than declared in the header of the LAS file");
+
+  std::vector<int32_t> xyz(n * 3);
+  std::vector<uint16_t> rgb(data.rgb_offset ? n * 3 : 0);
+  std::vector<uint16_t> intensity(n);
+  std::vector<uint8_t> classification(n);
+
+  for (size_t i = 0 ; i < n ; i++)
+  {
+    xyz[3*i] = points[i].X;
+    xyz[3*i+1] = points[i].Y;
+    xyz[3*i+2] = points[i].Z;
+    if (data.rgb_offset) std::copy(points[i].rgb, points[i].rgb + 3, &rgb[3*i]);
+    intensity[i] = points[i].intensity;
+    classification[i] = points[i].classification;
+  }
+
+  out.seekp(data.xyz_offset + written * 3 * sizeof(int32_t));
+  out.write(reinterpret_cast<const char*>(xyz.data()), xyz.size() * sizeof(int32_t));
+
+  if (data.rgb_offset)
+  {
+    out.seekp(data.rgb_offset + written * 3 * sizeof(uint16_t));
+    out.write(reinterpret_cast<const char*>(rgb.data()), rgb.size() * sizeof(uint16_t));
+  }
+
+  out.seekp(data.intensity_offset + written * sizeof(uint16_t));
+  out.write(reinterpret_cast<const char*>(intensity.data()), intensity.size() * sizeof(uint16_t));
+
+  out.seekp(data.classification_offset + written * sizeof(uint8_t));
+  out.write(reinterpret_cast<const char*>(classification.data()), classification.size());
+
+  if (!out)
+    throw std::runtime_error("Failed to write the points");
+
+  written += n;
+}
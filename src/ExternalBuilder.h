@@ -0,0 +1,52 @@
+#ifndef EXTERNALBUILDER_H
+#define EXTERNALBUILDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Hnof.h"
+#include "LasReader.h"
+#include "Octree.h"
+
+// Builds the octree of a LAS file that does not fit in memory and writes it in a self-contained
+// HNOF file (HNOF_DATA | HNOF_ORDERLESS). The points are streamed from the root: an octant keeps
+// the points that fall in a free cell of its grid and the other points are spilled in the
+// temporary file of the child they belong to. The children are then processed recursively one
+// after the other. An octant whose points fit in the memory budget is indexed in memory with the
+// frame of the whole point cloud. The octree is thus the same as the octree built in memory.
+class ExternalBuilder
+{
+public:
+  ExternalBuilder(const std::string& las, const std::string& tmpdir, size_t memory, bool verbose = false);
+  void write(const std::string& hnof);
+
+private:
+  // Reads up to n points and returns the number of points read. 0 when exhausted.
+  typedef std::function<size_t(LasRecord*, size_t)> Source;
+
+  void process(const Key& key, const Source& source, uint64_t count);
+  void append(const LasRecord* points, size_t n);
+  std::string bucket_path(const Key& key) const;
+
+  LasReader las;
+  std::string tmpdir;
+  size_t memory;
+  bool verbose;
+
+  double bbox[6];
+  uint64_t npoints;
+  Octree frame;
+
+  std::ofstream out;
+  HnofData data;
+  uint64_t written;
+  std::vector<HnofNode> nodes;
+  std::vector<std::string> temporary;
+  int spills;
+};
+
+#endif
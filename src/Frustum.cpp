@@ -13,9 +13,12 @@
 //***********************************************************************//
 
 #include "Frustum.h"
-#include <GL/gl.h>
 #include <math.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // We create an enum of the sides so we don't have to call each side 0 or 1.
 // This way it makes it more understandable and readable when dealing with frustum sides.
 enum FrustumSide
@@ -68,20 +71,12 @@ void NormalizePlane(float frustum[6][4], int side)
 /////
 ///////////////////////////////// CALCULATE FRUSTUM \\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\*
 
-void CFrustum::CalculateFrustum()
+void CFrustum::CalculateFrustum(const float proj[16], const float modl[16])
 {
-  float   proj[16];								// This will hold our projection matrix
-  float   modl[16];								// This will hold our modelview matrix
   float   clip[16];								// This will hold the clipping planes
 
-  // glGetFloatv() is used to extract information about our OpenGL world.
-  // Below, we pass in GL_PROJECTION_MATRIX to abstract our projection matrix.
-  // It then stores the matrix into an array of [16].
-  glGetFloatv( GL_PROJECTION_MATRIX, proj );
-
-  // By passing in GL_MODELVIEW_MATRIX, we can abstract our model view matrix.
-  // This also stores it in an array of [16].
-  glGetFloatv( GL_MODELVIEW_MATRIX, modl );
+  // The projection and modelview matrices are computed by the camera (see Camera::update()).
+  // They are not read back from OpenGL so the frustum can be computed on any thread.
 
   // Now that we have our modelview and projection matrix, if we combine these 2 matrices,
   // it will give us our clipping planes.  To combine 2 matrices, we multiply them.
@@ -252,7 +247,7 @@ bool CFrustum::SphereInFrustum( float x, float y, float z, float radius )
 /////
 ///////////////////////////////// CUBE IN FRUSTUM \\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\*
 
-bool CFrustum::CubeInFrustum( float x, float y, float z, float size )
+bool CFrustum::CubeInFrustum( float x, float y, float z, float size ) const
 {
   // This test is a bit more work, but not too much more complicated.
   // Basically, what is going on is, that we are given the center of the cube,
@@ -292,6 +287,73 @@ bool CFrustum::CubeInFrustum( float x, float y, float z, float size )
 }
 
 
+bool CFrustum::CubeInFrustum( float x, float y, float z, float size, unsigned char& planes ) const
+{
+  // The farthest corner in front of a plane is at a distance s + r where s is the distance of the
+  // center and r = size * (|A| + |B| + |C|). The nearest one is at s - r.
+  for(int i = 0; i < 6; i++ )
+  {
+    if ((planes & (1 << i)) == 0) continue;
+
+    const float* p = m_Frustum[i];
+    float s = p[A] * x + p[B] * y + p[C] * z + p[D];
+    float r = size * (fabsf(p[A]) + fabsf(p[B]) + fabsf(p[C]));
+
+    if (s + r <= 0) return false;
+    if (s - r > 0) planes &= ~(1 << i);
+  }
+
+  return true;
+}
+
+unsigned char CFrustum::ChildrenInFrustum( float x, float y, float z, float size, unsigned char planes, unsigned char children_planes[8] ) const
+{
+  unsigned char visible = 0xFF;
+  for (int k = 0 ; k < 8 ; k++) children_planes[k] = 0;
+
+#if defined(__SSE2__)
+  // The 8 children are 2 vectors of 4: children 0-3 below (z - size) and 4-7 above (z + size)
+  const __m128 sx = _mm_setr_ps(-1, 1, -1, 1);
+  const __m128 sy = _mm_setr_ps(-1, -1, 1, 1);
+  const __m128 zero = _mm_setzero_ps();
+
+  for (int i = 0 ; i < 6 ; i++)
+  {
+    if ((planes & (1 << i)) == 0) continue;
+
+    const float* p = m_Frustum[i];
+    float base = p[A] * x + p[B] * y + p[C] * z + p[D];
+    float r = size * (fabsf(p[A]) + fabsf(p[B]) + fabsf(p[C]));
+
+    // Distance of the centers of the children
+    __m128 sxy = _mm_add_ps(_mm_set1_ps(base), _mm_mul_ps(_mm_set1_ps(size), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[A]), sx), _mm_mul_ps(_mm_set1_ps(p[B]), sy))));
+    __m128 s0 = _mm_sub_ps(sxy, _mm_set1_ps(size * p[C]));
+    __m128 s1 = _mm_add_ps(sxy, _mm_set1_ps(size * p[C]));
+    __m128 vr = _mm_set1_ps(r);
+
+    int outside = _mm_movemask_ps(_mm_cmple_ps(_mm_add_ps(s0, vr), zero)) | (_mm_movemask_ps(_mm_cmple_ps(_mm_add_ps(s1, vr), zero)) << 4);
+    int crossing = _mm_movemask_ps(_mm_cmple_ps(_mm_sub_ps(s0, vr), zero)) | (_mm_movemask_ps(_mm_cmple_ps(_mm_sub_ps(s1, vr), zero)) << 4);
+
+    visible &= ~outside;
+    if (visible == 0) return 0;
+
+    for (int k = 0 ; k < 8 ; k++)
+      if (crossing & (1 << k)) children_planes[k] |= (1 << i);
+  }
+#else
+  for (int k = 0 ; k < 8 ; k++)
+  {
+    float cx = (k & 1) ? x + size : x - size;
+    float cy = (k & 2) ? y + size : y - size;
+    float cz = (k & 4) ? z + size : z - size;
+    children_planes[k] = planes;
+    if (!CubeInFrustum(cx, cy, cz, size, children_planes[k])) visible &= ~(1 << k);
+  }
+#endif
+
+  return visible;
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 //
 // * QUICK NOTES *
@@ -6,8 +6,9 @@ class CFrustum
 
 public:
 
-  // Call this every time the camera moves to update the frustum
-  void CalculateFrustum();
+  // Call this every time the camera moves to update the frustum. The matrices are column-major
+  // as in OpenGL.
+  void CalculateFrustum(const float proj[16], const float modl[16]);
 
   // This takes a 3D point and returns TRUE if it's inside of the frustum
   bool PointInFrustum(float x, float y, float z);
@@ -16,7 +17,20 @@ public:
   bool SphereInFrustum(float x, float y, float z, float radius);
 
   // This takes the center and half the length of the cube.
-  bool CubeInFrustum( float x, float y, float z, float size );
+  bool CubeInFrustum( float x, float y, float z, float size ) const;
+
+  // Same but tests only the planes in 'planes' (bit i for the plane i) and removes from 'planes'
+  // the planes the cube is entirely in front of. The subcubes of the cube are in front of them too
+  // so they don't need to be tested again. planes == 0 means the cube is entirely inside.
+  bool CubeInFrustum( float x, float y, float z, float size, unsigned char& planes ) const;
+
+  // Tests the 8 children of a cube at once. Takes the center of the cube and half the length of a
+  // child. The child k is offset by +size on x if bit 0 of k, on y if bit 1, on z if bit 2 (see
+  // Key::get_children()). Returns the bit k set if the child k is in the frustum and its planes
+  // still to test in children_planes[k].
+  unsigned char ChildrenInFrustum( float x, float y, float z, float size, unsigned char planes, unsigned char children_planes[8] ) const;
+
+  static const unsigned char ALL_PLANES = 0x3F;
 
 private:
 
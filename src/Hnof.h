@@ -0,0 +1,80 @@
+#ifndef HNOF_H
+#define HNOF_H
+
+#include <cstdint>
+
+// HNOF v2 layout. All sections are aligned so the file can be memory mapped and used in place.
+// Sections are located by the offsets of the header and are usually in this order:
+// - a 128 bytes header
+// - the node table: one HnofNode per node, level by level
+// - the index payload: the indices of the points in the octree order, nodes being ranges of it.
+//   If compressed (HNOF_COMPRESSED) the payload starts with nnodes+1 uint64 offsets of the stream
+//   of each node relative to the end of this table, followed by the streams (see BitPacking.h).
+// - optionally (HNOF_DATA) a HnofData descriptor followed by the coordinates and the attributes
+//   of the points in the octree order so the file is self-contained and nodes can be loaded on
+//   demand without the original data
+// A file without the index payload (HNOF_ORDERLESS) only has the points in the octree order. It is
+// written by the external build of point clouds that do not fit in memory.
+const char HNOF_SIGNATURE[4] = {'H', 'N', 'O', 'F'};
+const uint32_t HNOF_VERSION_MAJOR = 2;
+const uint32_t HNOF_VERSION_MINOR = 1;
+const uint64_t HNOF_ALIGNMENT = 64;
+
+const uint64_t HNOF_DATA = 1;
+const uint64_t HNOF_COMPRESSED = 2;
+const uint64_t HNOF_ORDERLESS = 4;
+
+struct HnofHeader
+{
+  char signature[4];
+  uint32_t version_major;
+  uint32_t version_minor;
+  uint32_t header_size;
+  double xmin;
+  double ymin;
+  double zmin;
+  double xmax;
+  double ymax;
+  double zmax;
+  int32_t grid_size;
+  int32_t max_depth;
+  uint64_t npoints;
+  uint64_t nnodes;
+  uint64_t node_offset;
+  uint64_t index_offset;
+  uint64_t flags;
+  uint64_t data_offset;
+  uint64_t fingerprint; // fingerprint of the point cloud indexed (0 if unknown)
+};
+
+struct HnofNode
+{
+  int32_t d;
+  int32_t x;
+  int32_t y;
+  int32_t z;
+  uint64_t offset;
+  uint64_t count;
+};
+
+// Coordinates are stored as int32 X,Y,Z triplets (x = X*scale + offset). RGB as uint16 triplets
+// (16 bits colours like in LAS files), intensity as uint16 and classification as uint8. An offset
+// of 0 means the attribute is absent.
+struct HnofData
+{
+  double scale[3];
+  double offset[3];
+  double bbox[6];
+  uint64_t xyz_offset;
+  uint64_t rgb_offset;
+  uint64_t intensity_offset;
+  uint64_t classification_offset;
+};
+
+static_assert(sizeof(HnofHeader) == 128, "HNOF header must be 128 bytes");
+static_assert(sizeof(HnofNode) == 32, "HNOF node must be 32 bytes");
+static_assert(sizeof(HnofData) == 128, "HNOF data descriptor must be 128 bytes");
+
+inline uint64_t hnof_align(uint64_t offset) { return (offset + HNOF_ALIGNMENT - 1) / HNOF_ALIGNMENT * HNOF_ALIGNMENT; }
+
+#endif
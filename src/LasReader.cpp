@@ -0,0 +1,210 @@
+#include "LasReader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+template<typename T> static T get(const uint8_t* p)
+{
+  T v;
+  std::memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+LasReader::LasReader(const std::string& filename) : file(filename)
+{
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open file for reading: " + filename);
+
+  const uint8_t* data = file.get_data();
+  size_t size = file.get_size();
+
+  if (size < 227 || std::memcmp(data, "LASF", 4) != 0)
+    throw std::runtime_error("Invalid LAS file: " + filename);
+
+  uint8_t version_major = data[24];
+  version_minor = data[25];
+  if (version_major != 1 || version_minor < 2 || version_minor > 4)
+    throw std::runtime_error("Unsupported LAS version " + std::to_string(version_major) + "." + std::to_string(version_minor) + ": " + filename);
+
+  point_offset = get<uint32_t>(data + 96);
+  format = data[104];
+  record_length = get<uint16_t>(data + 105);
+  npoints = get<uint32_t>(data + 107);
+
+  // Bit 7 of the point format flags LAZ compressed points
+  if (format & 0x80)
+    throw std::runtime_error("Compressed LAS (LAZ) are not supported by the native reader: " + filename);
+
+  format &= 0x3F;
+  if (format > 10)
+    throw std::runtime_error("Unsupported point format " + std::to_string(format) + ": " + filename);
+
+  if (version_minor == 4)
+  {
+    if (size < 375)
+      throw std::runtime_error("Invalid LAS file: " + filename);
+
+    uint64_t n = get<uint64_t>(data + 247);
+    if (n > 0) npoints = n;
+  }
+
+  for (int k = 0 ; k < 3 ; k++)
+  {
+    scale[k] = get<double>(data + 131 + 8*k);
+    offset[k] = get<double>(data + 155 + 8*k);
+  }
+
+  // The header stores max then min for each axis
+  for (int k = 0 ; k < 3 ; k++)
+  {
+    bbox[k+3] = get<double>(data + 179 + 16*k);
+    bbox[k] = get<double>(data + 187 + 16*k);
+  }
+
+  // Offsets of RGB in the record of each point format (0 = no RGB)
+  static const int rgb[11] = {0, 0, 20, 28, 0, 28, 0, 30, 30, 0, 30};
+  static const int min_length[11] = {20, 28, 26, 34, 57, 63, 30, 36, 38, 59, 67};
+
+  rgb_offset = rgb[format];
+
+  if (record_length < min_length[format])
+    throw std::runtime_error("Invalid point record length: " + filename);
+
+  if (point_offset + npoints * record_length > size)
+    throw std::runtime_error("Truncated LAS file: " + filename);
+}
+
+// Points [start, end) are decoded in the point cloud. The colours are reduced to 8 bits with 'shift'.
+void LasReader::decode(PointCloud& pc, uint64_t start, uint64_t end, int shift) const
+{
+  const uint8_t* records = file.get_data() + point_offset;
+
+  // The classification is a 5 bits field in the legacy formats and a byte in the formats 6 to 10
+  bool extended = format >= 6;
+
+  for (uint64_t i = start ; i < end ; i++)
+  {
+    const uint8_t* p = records + i * record_length;
+    pc.XYZ[3*i]   = get<int32_t>(p);
+    pc.XYZ[3*i+1] = get<int32_t>(p + 4);
+    pc.XYZ[3*i+2] = get<int32_t>(p + 8);
+    pc.I[i] = get<uint16_t>(p + 12);
+    pc.C[i] = (extended) ? p[16] : (p[15] & 0x1F);
+
+    if (rgb_offset)
+      pc.RGBA[i] = rgba(get<uint16_t>(p + rgb_offset), get<uint16_t>(p + rgb_offset + 2), get<uint16_t>(p + rgb_offset + 4), shift);
+  }
+}
+
+// Points [start, start+count) are decoded without conversion of the coordinates
+void LasReader::read(uint64_t start, uint64_t count, LasRecord* out) const
+{
+  const uint8_t* records = file.get_data() + point_offset;
+  bool extended = format >= 6;
+
+  for (uint64_t k = 0 ; k < count ; k++)
+  {
+    const uint8_t* p = records + (start + k) * record_length;
+    LasRecord& r = out[k];
+    r.X = get<int32_t>(p);
+    r.Y = get<int32_t>(p + 4);
+    r.Z = get<int32_t>(p + 8);
+    r.intensity = get<uint16_t>(p + 12);
+    r.classification = (extended) ? p[16] : (p[15] & 0x1F);
+
+    if (rgb_offset)
+    {
+      r.rgb[0] = get<uint16_t>(p + rgb_offset);
+      r.rgb[1] = get<uint16_t>(p + rgb_offset + 2);
+      r.rgb[2] = get<uint16_t>(p + rgb_offset + 4);
+    }
+    else
+    {
+      r.rgb[0] = r.rgb[1] = r.rgb[2] = 0;
+    }
+  }
+}
+
+// Bounding box of the records (xmin, ymin, zmin, xmax, ymax, zmax). The bounding box of the header
+// is often stale or rounded and cannot be trusted to contain all the points.
+void LasReader::read_bbox(double* bbox) const
+{
+  if (npoints == 0)
+  {
+    std::copy(this->bbox, this->bbox + 6, bbox);
+    return;
+  }
+
+  const uint8_t* records = file.get_data() + point_offset;
+
+  int32_t min[3] = {INT32_MAX, INT32_MAX, INT32_MAX};
+  int32_t max[3] = {INT32_MIN, INT32_MIN, INT32_MIN};
+  for (uint64_t i = 0 ; i < npoints ; i++)
+  {
+    const uint8_t* p = records + i * record_length;
+    for (int k = 0 ; k < 3 ; k++)
+    {
+      int32_t v = get<int32_t>(p + 4*k);
+      min[k] = std::min(min[k], v);
+      max[k] = std::max(max[k], v);
+    }
+  }
+
+  // Same conversion as the one of the points so the bounding box is the one of a PointCloud
+  for (int k = 0 ; k < 3 ; k++)
+  {
+    bbox[k] = min[k] * scale[k] + offset[k];
+    bbox[k+3] = max[k] * scale[k] + offset[k];
+  }
+}
+
+// The points are decoded by batches of 1M points distributed on ncpu threads. A batch is a
+// contiguous range of records so the pages of the file are read sequentially.
+PointCloud LasReader::read(int ncpu) const
+{
+  if (npoints > UINT32_MAX)
+    throw std::runtime_error("Spatial indexation is bound to 4,294 billion points");
+
+  PointCloud pc;
+  pc.allocate(npoints, has_rgb(), true, true, scale, offset);
+
+  // The points are in the order of the file, not in the order of an octree
+  pc.reordered = false;
+
+  // The specification says 16 bits colours but many files have 8 bits colours. A sample of the
+  // records tells which one before the batches are decoded.
+  int shift = 0;
+  if (rgb_offset)
+  {
+    const uint8_t* records = file.get_data() + point_offset;
+    uint64_t stride = std::max<uint64_t>(1, npoints / 100000);
+    int max = 0;
+    for (uint64_t i = 0 ; i < npoints ; i += stride)
+    {
+      const uint8_t* p = records + i * record_length + rgb_offset;
+      max = std::max<int>(max, std::max(get<uint16_t>(p), std::max(get<uint16_t>(p + 2), get<uint16_t>(p + 4))));
+    }
+    shift = PointCloud::rgb_shift(max);
+  }
+
+  const uint64_t batch = 1000000;
+  uint64_t nbatches = (npoints + batch - 1) / batch;
+  int nthreads = (int)std::max<uint64_t>(1, std::min<uint64_t>(std::max(ncpu, 1), nbatches));
+
+  std::vector<std::thread> threads;
+  for (int t = 0 ; t < nthreads ; t++)
+  {
+    threads.emplace_back([this, &pc, t, nthreads, nbatches, batch, shift]()
+    {
+      for (uint64_t b = t ; b < nbatches ; b += nthreads)
+        decode(pc, b * batch, std::min(npoints, (b + 1) * batch), shift);
+    });
+  }
+
+  for (auto& thread : threads) thread.join();
+
+  return pc;
+}
@@ -0,0 +1,53 @@
+#ifndef LASREADER_H
+#define LASREADER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "MappedFile.h"
+#include "PointCloud.h"
+
+// Point as stored in a LAS file with integer coordinates (x = X*scale + offset)
+struct LasRecord
+{
+  int32_t X;
+  int32_t Y;
+  int32_t Z;
+  uint16_t intensity;
+  uint16_t rgb[3];
+  uint8_t classification;
+};
+
+// Reader of uncompressed LAS 1.2 to 1.4 files (point formats 0 to 10). The point records are
+// memory mapped and decoded by batches directly in a PointCloud without going through R.
+class LasReader
+{
+public:
+  LasReader(const std::string& filename);
+
+  PointCloud read(int ncpu = 1) const;
+  void read(uint64_t start, uint64_t count, LasRecord* out) const;
+  uint64_t get_npoints() const { return npoints; };
+  bool has_rgb() const { return rgb_offset > 0; };
+  const double* get_scale() const { return scale; };
+  const double* get_offset() const { return offset; };
+  const double* get_bbox() const { return bbox; };
+  void read_bbox(double* bbox) const;
+
+private:
+  void decode(PointCloud& pc, uint64_t start, uint64_t end, int shift) const;
+
+  MappedFile file;
+  uint8_t version_minor;
+  uint8_t format;
+  uint16_t record_length;
+  uint32_t point_offset;
+  uint64_t npoints;
+  double scale[3];
+  double offset[3];
+  double bbox[6]; // xmin, ymin, zmin, xmax, ymax, zmax from the header
+  int rgb_offset; // offset of the RGB fields in a record, 0 if absent
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename) : MappedFile()
+{
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Failed to open file for reading: " + filename);
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+  {
+    CloseHandle(file);
+    throw std::runtime_error("Failed to map empty file: " + filename);
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (mapping == NULL)
+    throw std::runtime_error("Failed to map file: " + filename);
+
+  void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (ptr == NULL)
+  {
+    CloseHandle(mapping);
+    throw std::runtime_error("Failed to map file: " + filename);
+  }
+
+  data = static_cast<const uint8_t*>(ptr);
+  length = size.QuadPart;
+  handle = mapping;
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open file for reading: " + filename);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    ::close(fd);
+    throw std::runtime_error("Failed to map empty file: " + filename);
+  }
+
+  void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED)
+    throw std::runtime_error("Failed to map file: " + filename);
+
+  data = static_cast<const uint8_t*>(ptr);
+  length = st.st_size;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept : MappedFile()
+{
+  *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+  if (this != &other)
+  {
+    close();
+    std::swap(data, other.data);
+    std::swap(length, other.length);
+    std::swap(handle, other.handle);
+  }
+  return *this;
+}
+
+void MappedFile::close()
+{
+  if (data == nullptr) return;
+
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+  CloseHandle(static_cast<HANDLE>(handle));
+#else
+  munmap(const_cast<uint8_t*>(data), length);
+#endif
+
+  data = nullptr;
+  length = 0;
+  handle = nullptr;
+}
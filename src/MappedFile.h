@@ -0,0 +1,32 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file. The pages are loaded by the OS on demand.
+class MappedFile
+{
+public:
+  MappedFile() : data(nullptr), length(0), handle(nullptr) {};
+  MappedFile(const std::string& filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+
+  bool is_open() const { return data != nullptr; };
+  const uint8_t* get_data() const { return data; };
+  size_t get_size() const { return length; };
+  void close();
+
+private:
+  const uint8_t* data;
+  size_t length;
+  void* handle; // Windows file mapping handle
+};
+
+#endif
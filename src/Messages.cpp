@@ -0,0 +1,37 @@
+#include "Messages.h"
+
+#include <R_ext/Print.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static std::mutex mutex;
+static std::vector<std::string> queue;
+
+void post_message(const char* format, ...)
+{
+  char buffer[1024];
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  queue.emplace_back(buffer);
+}
+
+void flush_messages()
+{
+  std::vector<std::string> messages;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.swap(queue);
+  }
+
+  for (const auto& m : messages) Rprintf("%s", m.c_str());
+}
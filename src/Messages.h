@@ -0,0 +1,10 @@
+#ifndef MESSAGES_H
+#define MESSAGES_H
+
+// Messages of the C++ code to the R console. R must only be called from the main thread and the
+// messages may come from worker threads or from the rendering thread of a detached viewer, so
+// they are queued by post_message() and printed by flush_messages() called by the main thread.
+void post_message(const char* format, ...);
+void flush_messages();
+
+#endif
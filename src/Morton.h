@@ -0,0 +1,45 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <cstdint>
+
+// 3D Morton codes on 21 bits per axis. The bits of x, y and z are interleaved such as the 3 most
+// significant bits of a code truncated to d levels are the direction of the child of depth d.
+
+// Spreads the 21 lowest bits of a with two 0 between each bit
+inline uint64_t morton_split(uint32_t a)
+{
+  uint64_t x = a & 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffff;
+  x = (x | x << 16) & 0x1f0000ff0000ff;
+  x = (x | x << 8)  & 0x100f00f00f00f00f;
+  x = (x | x << 4)  & 0x10c30c30c30c30c3;
+  x = (x | x << 2)  & 0x1249249249249249;
+  return x;
+}
+
+// Inverse of morton_split
+inline uint32_t morton_compact(uint64_t x)
+{
+  x &= 0x1249249249249249;
+  x = (x ^ (x >> 2))  & 0x10c30c30c30c30c3;
+  x = (x ^ (x >> 4))  & 0x100f00f00f00f00f;
+  x = (x ^ (x >> 8))  & 0x1f0000ff0000ff;
+  x = (x ^ (x >> 16)) & 0x1f00000000ffff;
+  x = (x ^ (x >> 32)) & 0x1fffff;
+  return (uint32_t)x;
+}
+
+inline uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+  return morton_split(x) | (morton_split(y) << 1) | (morton_split(z) << 2);
+}
+
+inline void morton_decode(uint64_t code, uint32_t& x, uint32_t& y, uint32_t& z)
+{
+  x = morton_compact(code);
+  y = morton_compact(code >> 1);
+  z = morton_compact(code >> 2);
+}
+
+#endif
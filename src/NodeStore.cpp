@@ -0,0 +1,204 @@
+#include "NodeStore.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+NodeStore::NodeStore(const std::string& filename, const HnofData& data, uint64_t npoints, size_t budget, int nthreads) : file(filename)
+{
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open file for reading: " + filename);
+
+  if (data.xyz_offset == 0)
+    throw std::runtime_error("The file does not contain the points: " + filename);
+
+  this->data = data;
+  this->budget = budget;
+  this->used = 0;
+  this->frame = 0;
+  this->updated = false;
+  this->stop = false;
+
+  // The colours of all the octants are reduced to 8 bits the same way so the shift is chosen
+  // once from a sample of the whole RGB section
+  this->rgb_shift = 0;
+  if (data.rgb_offset)
+  {
+    const uint8_t* rgb = file.get_data() + data.rgb_offset;
+    uint64_t stride = std::max<uint64_t>(1, npoints / 100000);
+    int max = 0;
+    for (uint64_t i = 0 ; i < npoints ; i += stride)
+    {
+      uint16_t c[3];
+      std::memcpy(c, rgb + i * sizeof(c), sizeof(c));
+      max = std::max<int>(max, std::max(c[0], std::max(c[1], c[2])));
+    }
+    this->rgb_shift = PointCloud::rgb_shift(max);
+  }
+
+  nthreads = std::max(1, nthreads);
+  for (int i = 0 ; i < nthreads ; i++)
+    workers.emplace_back(&NodeStore::work, this);
+}
+
+NodeStore::~NodeStore()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+
+  cv.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+// Never blocks on I/O. Returns nullptr and schedules the loading if the octant is not resident.
+const PointCloud* NodeStore::request(uint64_t offset, uint64_t count)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = cache.find(offset);
+  if (it != cache.end())
+  {
+    it->second.last_used = frame;
+    return &it->second.points;
+  }
+
+  missing.insert(offset);
+  if (loading.count(offset) == 0 && queued.insert(offset).second)
+  {
+    queue.emplace_back(offset, count);
+    cv.notify_one();
+  }
+
+  return nullptr;
+}
+
+// The requests of the previous frame that are not being loaded are dropped. Octants still
+// visible are requested again in the new order of priority.
+void NodeStore::next_frame()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  queue.clear();
+  queued.clear();
+  missing.clear();
+  frame++;
+}
+
+void NodeStore::work()
+{
+  while (true)
+  {
+    std::pair<uint64_t, uint64_t> task;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return stop || !queue.empty(); });
+      if (stop) return;
+
+      task = queue.front();
+      queue.pop_front();
+      queued.erase(task.first);
+      loading.insert(task.first);
+    }
+
+    Entry entry;
+    entry.points = load(task.first, task.second);
+
+    // The frame is drawn again only if the octant is still requested. An octant no longer in
+    // view is kept for later but does not change the frame.
+    bool visible;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      entry.last_used = frame;
+      used += entry.points.memory();
+      cache.emplace(task.first, std::move(entry));
+      loading.erase(task.first);
+      visible = missing.erase(task.first) > 0;
+    }
+
+    if (visible) updated = true;
+  }
+}
+
+// Decodes the points [offset, offset+count) of the octree order. The sections are contiguous so
+// only the pages of the octant are read from the disk.
+PointCloud NodeStore::load(uint64_t offset, uint64_t count) const
+{
+  const uint8_t* base = file.get_data();
+
+  PointCloud pc;
+  pc.allocate(count, data.rgb_offset != 0, data.intensity_offset != 0, data.classification_offset != 0, data.scale, data.offset);
+
+  // The coordinates are kept as stored in the file
+  const uint8_t* xyz = base + data.xyz_offset + offset * 3 * sizeof(int32_t);
+  std::memcpy(pc.XYZ.data(), xyz, count * 3 * sizeof(int32_t));
+
+  if (data.rgb_offset)
+  {
+    const uint8_t* rgb = base + data.rgb_offset + offset * 3 * sizeof(uint16_t);
+    for (uint64_t i = 0 ; i < count ; i++)
+    {
+      uint16_t c[3];
+      std::memcpy(c, rgb + i * sizeof(c), sizeof(c));
+      pc.RGBA[i] = rgba(c[0], c[1], c[2], rgb_shift);
+    }
+  }
+
+  if (data.intensity_offset)
+  {
+    const uint8_t* intensity = base + data.intensity_offset + offset * sizeof(uint16_t);
+    for (uint64_t i = 0 ; i < count ; i++)
+    {
+      uint16_t v;
+      std::memcpy(&v, intensity + i * sizeof(v), sizeof(v));
+      pc.I[i] = v;
+    }
+  }
+
+  if (data.classification_offset)
+  {
+    const uint8_t* classification = base + data.classification_offset + offset;
+    for (uint64_t i = 0 ; i < count ; i++) pc.C[i] = classification[i];
+  }
+
+  return pc;
+}
+
+void NodeStore::evict()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (used <= budget) return;
+
+  std::vector<std::pair<uint64_t, uint64_t>> candidates; // (last_used, offset)
+  for (const auto& pair : cache)
+  {
+    if (pair.second.last_used < frame)
+      candidates.emplace_back(pair.second.last_used, pair.first);
+  }
+
+  std::sort(candidates.begin(), candidates.end());
+
+  for (const auto& candidate : candidates)
+  {
+    if (used <= budget) break;
+    auto it = cache.find(candidate.second);
+    used -= it->second.points.memory();
+    cache.erase(it);
+  }
+}
+
+size_t NodeStore::memory()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return used;
+}
+
+// Whether octants requested in the current frame are being loaded. The loads of the octants
+// requested in previous frames only do not count.
+bool NodeStore::is_loading()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return !missing.empty();
+}
@@ -0,0 +1,72 @@
+#ifndef NODESTORE_H
+#define NODESTORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Hnof.h"
+#include "MappedFile.h"
+#include "Octree.h"
+#include "PointCloud.h"
+
+// Points of the octants of a self-contained HNOF file (HNOF_DATA). The octants are decoded on
+// demand by a pool of loader threads and kept in memory within a memory budget. The least
+// recently used octants are released first but octants used in the current frame are never
+// released.
+//
+// request(), next_frame() and evict() must be called from the rendering thread only. A point
+// cloud returned by request() remains valid until the next call to evict().
+class NodeStore
+{
+public:
+  NodeStore(const std::string& filename, const HnofData& data, uint64_t npoints, size_t budget, int nthreads = 1);
+  ~NodeStore();
+
+  const PointCloud* request(uint64_t offset, uint64_t count);
+  PointCloud load(uint64_t offset, uint64_t count) const;
+  void next_frame();
+  void evict();
+  bool has_updates() { return updated.exchange(false); };
+  bool is_loading();
+  size_t memory();
+  size_t get_budget() const { return budget; };
+
+private:
+  struct Entry
+  {
+    PointCloud points;
+    uint64_t last_used;
+  };
+
+  void work();
+
+  MappedFile file;
+  HnofData data;
+  size_t budget;
+  size_t used;
+  int rgb_shift;
+  uint64_t frame;
+  std::unordered_map<uint64_t, Entry> cache; // keyed by the offset of the octant
+
+  // Octants to load (offset, count) by priority. The queue is rebuilt every frame.
+  std::deque<std::pair<uint64_t, uint64_t>> queue;
+  std::unordered_set<uint64_t> queued;
+  std::unordered_set<uint64_t> loading;
+  std::unordered_set<uint64_t> missing; // requested in the current frame and not resident yet
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<bool> updated;
+  bool stop;
+};
+
+#endif
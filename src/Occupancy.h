@@ -0,0 +1,116 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Set of the occupied cells of the grid of an octant. Sparse octants store their cells in an open
+// addressing hash table with linear probing. When the table becomes bigger than a bitset of the
+// whole grid it is converted into a dense bitset. It is only needed to build the index.
+class Occupancy
+{
+public:
+  Occupancy(uint32_t ncells = 0) : ncells(ncells), count(0), log2cap(0) {}
+
+  bool contains(uint32_t cell) const
+  {
+    if (!bits.empty()) return (bits[cell >> 6] >> (cell & 63)) & 1;
+    if (table.empty()) return false;
+
+    uint32_t mask = table.size() - 1;
+    for (uint32_t h = hash(cell) ; ; h = (h + 1) & mask)
+    {
+      if (table[h] == cell) return true;
+      if (table[h] == EMPTY) return false;
+    }
+  }
+
+  // Returns false if the cell was already occupied
+  bool insert(uint32_t cell)
+  {
+    if (!bits.empty())
+    {
+      uint64_t bit = (uint64_t)1 << (cell & 63);
+      if (bits[cell >> 6] & bit) return false;
+      bits[cell >> 6] |= bit;
+      count++;
+      return true;
+    }
+
+    if ((count + 1) * 2 > table.size())
+    {
+      grow();
+      if (!bits.empty()) return insert(cell);
+    }
+
+    uint32_t mask = table.size() - 1;
+    uint32_t h = hash(cell);
+    while (table[h] != EMPTY)
+    {
+      if (table[h] == cell) return false;
+      h = (h + 1) & mask;
+    }
+
+    table[h] = cell;
+    count++;
+    return true;
+  }
+
+  void clear()
+  {
+    std::vector<uint32_t>().swap(table);
+    std::vector<uint64_t>().swap(bits);
+    count = 0;
+    log2cap = 0;
+  }
+
+  size_t size() const { return count; }
+  size_t memory() const { return table.capacity() * sizeof(uint32_t) + bits.capacity() * sizeof(uint64_t); }
+
+private:
+  static constexpr uint32_t EMPTY = UINT32_MAX;
+
+  uint32_t hash(uint32_t cell) const { return (cell * 2654435761u) >> (32 - log2cap); }
+
+  void grow()
+  {
+    size_t capacity = table.empty() ? 16 : table.size() * 2;
+
+    // Switch to the dense representation when it becomes smaller
+    if (ncells > 0 && capacity * sizeof(uint32_t) >= (size_t)ncells / 8)
+    {
+      bits.assign((ncells + 63) / 64, 0);
+      for (auto cell : table)
+      {
+        if (cell != EMPTY)
+          bits[cell >> 6] |= (uint64_t)1 << (cell & 63);
+      }
+      std::vector<uint32_t>().swap(table);
+      return;
+    }
+
+    std::vector<uint32_t> old;
+    old.swap(table);
+    table.assign(capacity, EMPTY);
+    log2cap = 0;
+    while (((size_t)1 << log2cap) < capacity) log2cap++;
+
+    uint32_t mask = table.size() - 1;
+    for (auto cell : old)
+    {
+      if (cell == EMPTY) continue;
+      uint32_t h = hash(cell);
+      while (table[h] != EMPTY) h = (h + 1) & mask;
+      table[h] = cell;
+    }
+  }
+
+  uint32_t ncells;
+  uint32_t count;
+  uint32_t log2cap;
+  std::vector<uint32_t> table;
+  std::vector<uint64_t> bits;
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include "Octree.h"
+#include "Morton.h"
+#include "BitPacking.h"
+#include "Hnof.h"
 
 #include <cstdio>
 #include <cmath>
@@ -7,6 +10,11 @@
 #include <algorithm>
 #include <fstream>
 #include <stdexcept>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
 
 Key::Key(int32_t d, int32_t x, int32_t y, int32_t z) : d(d), x(x), y(y), z(z) {}
 Key::Key() : Key(-1, -1, -1, -1) {}
@@ -47,15 +55,114 @@ Node::Node()
   bbox[2] = 0;
   bbox[3] = 0;
   screen_size = 0;
+  offset = 0;
+  count = 0;
 }
 
-void Node::insert(size_t idx, uint32_t cell)
+uint64_t Registry::encode(const Key& key)
 {
-  point_idx.push_back(idx);
+  return ((uint64_t)1 << (3 * key.d)) | morton_encode(key.x, key.y, key.z);
+}
+
+// Slot of the code or empty slot where it would be inserted. The table is never full.
+size_t Registry::probe(uint64_t code) const
+{
+  size_t mask = table.size() - 1;
+  size_t h = (code * 0x9E3779B97F4A7C15ULL) >> (64 - log2cap); // Fibonacci hashing
+  while (table[h].code != code && table[h].code != EMPTY) h = (h + 1) & mask;
+  return h;
+}
+
+Registry::iterator Registry::find(const Key& key)
+{
+  if (count == 0) return end();
+  const Slot& slot = table[probe(encode(key))];
+  return (slot.code == EMPTY) ? end() : iterator(&chunks, slot.index);
+}
+
+Registry::const_iterator Registry::find(const Key& key) const
+{
+  if (count == 0) return end();
+  const Slot& slot = table[probe(encode(key))];
+  return (slot.code == EMPTY) ? end() : const_iterator(&chunks, slot.index);
+}
+
+// Same as std::unordered_map::emplace(): does nothing if the key already exists
+std::pair<Registry::iterator, bool> Registry::emplace(const Key& key, Node&& node)
+{
+  if ((count + 1) * 2 > table.size()) rehash(std::max<size_t>(16, table.size() * 2));
+
+  uint64_t code = encode(key);
+  Slot& slot = table[probe(code)];
+  if (slot.code != EMPTY) return {iterator(&chunks, slot.index), false};
+
+  if ((count >> CHUNK_SHIFT) == chunks.size())
+    chunks.emplace_back(new value_type[CHUNK_MASK + 1]);
+
+  value_type& value = chunks[count >> CHUNK_SHIFT][count & CHUNK_MASK];
+  value.first = key;
+  value.second = std::move(node);
+
+  slot.code = code;
+  slot.index = count;
+  count++;
+
+  return {iterator(&chunks, slot.index), true};
+}
+
+// Moves the nodes of 'other' into this registry. The nodes whose key already exists are dropped.
+void Registry::merge(Registry& other)
+{
+  reserve(count + other.count);
+  for (auto& pair : other) emplace(pair.first, std::move(pair.second));
+  arena.merge(other.arena);
+  other.clear();
+}
+
+void Registry::reserve(size_t n)
+{
+  size_t capacity = 16;
+  while (capacity < 2 * n) capacity *= 2;
+  if (capacity > table.size()) rehash(capacity);
+  chunks.reserve((n + CHUNK_MASK) >> CHUNK_SHIFT);
+}
+
+void Registry::clear()
+{
+  Chunks().swap(chunks);
+  std::vector<Slot>().swap(table);
+  arena.clear();
+  count = 0;
+  log2cap = 0;
+}
+
+size_t Registry::memory() const
+{
+  return table.capacity() * sizeof(Slot) + chunks.size() * (CHUNK_MASK + 1) * sizeof(value_type) + arena.memory();
+}
+
+void Registry::rehash(size_t capacity)
+{
+  std::vector<Slot> old(capacity, {EMPTY, 0});
+  old.swap(table);
+
+  log2cap = 0;
+  while (((size_t)1 << log2cap) < capacity) log2cap++;
+
+  for (const auto& slot : old)
+  {
+    if (slot.code != EMPTY) table[probe(slot.code)] = slot;
+  }
+}
+
+void Node::insert(size_t idx, int cell, PointArena& arena)
+{
+  point_idx.push_back(idx, arena);
+  count++;
   if (cell >= 0) occupancy.insert(cell); // cell = -1 means that recording the location of the point is useless (save memory)
 };
 
-Octree::Octree(double* x, double* y, double* z, size_t n)
+Octree::Octree(const double* x, const double* y, const double* z, size_t n)
 {
   if (n > UINT32_MAX)
     throw std::runtime_error("Spatial indexation is bound to 4,294 billion points");
@@ -64,9 +171,15 @@ Octree::Octree(double* x, double* y, double* z, size_t n)
   this->x = x;
   this->y = y;
   this->z = z;
+  this->xyz = nullptr;
 
   this->max_depth = 0;
   this->grid_size = 128;
+  this->finalized = false;
+  this->order_data = nullptr;
+  this->fingerprint = 0;
+  this->hnof_flags = 0;
+  this->hnof_data = HnofData();
 
   // Compute the bounding box
   xmin =  INFD;
@@ -85,6 +198,60 @@ Octree::Octree(double* x, double* y, double* z, size_t n)
     if (z[i] > zmax) zmax = z[i];
   }
 
+  init_frame();
+}
+
+// Octree of the points of a point cloud with either double or integer coordinates. The point
+// cloud must not be modified until the octree is built.
+Octree::Octree(const PointCloud& points) : Octree()
+{
+  if (points.npoints > UINT32_MAX)
+    throw std::runtime_error("Spatial indexation is bound to 4,294 billion points");
+
+  this->npoint = points.npoints;
+  this->x = points.x;
+  this->y = points.y;
+  this->z = points.z;
+  this->xyz = points.xyz;
+  std::copy(points.scale, points.scale + 3, scale);
+  std::copy(points.offset, points.offset + 3, offset);
+
+  xmin = ymin = zmin =  INFD;
+  xmax = ymax = zmax = -INFD;
+  for (size_t i = 0 ; i < npoint ; i++)
+  {
+    double px, py, pz;
+    get_point(i, px, py, pz);
+    if (px < xmin) xmin = px;
+    if (px > xmax) xmax = px;
+    if (py < ymin) ymin = py;
+    if (py > ymax) ymax = py;
+    if (pz < zmin) zmin = pz;
+    if (pz > zmax) zmax = pz;
+  }
+
+  init_frame();
+}
+
+// Frame of the octree of n points within a bounding box (xmin, ymin, zmin, xmax, ymax, zmax)
+// without the points. Used to build the octree of point clouds that do not fit in memory
+// with build_subtree().
+Octree::Octree(const double* bbox, uint64_t n) : Octree()
+{
+  this->npoint = n;
+  this->xmin = bbox[0];
+  this->ymin = bbox[1];
+  this->zmin = bbox[2];
+  this->xmax = bbox[3];
+  this->ymax = bbox[4];
+  this->zmax = bbox[5];
+
+  init_frame();
+}
+
+// Turns the bounding box into a cube and computes the depth of the octree
+void Octree::init_frame()
+{
   double center_x = (xmin+xmax)/2;
   double center_y = (ymin+ymax)/2;
   double center_z = (zmin+zmax)/2;
@@ -97,7 +264,7 @@ Octree::Octree(double* x, double* y, double* z, size_t n)
   ymax = center_y + halfsize;
   zmax = center_z + halfsize;
 
-  compute_max_depth(n, 10000);
+  compute_max_depth(npoint, 10000);
 }
 
 void Octree::compute_max_depth(size_t npts, size_t max_points_per_octant)
@@ -124,39 +291,42 @@ void Octree::compute_max_depth(size_t npts, size_t max_points_per_octant)
 
 bool Octree::insert(uint32_t i)
 {
-  std::unordered_map<Key, Node, KeyHasher>::iterator it;
+  return insert(i, 0, max_depth, registry);
+}
+
+// Search a place to insert the point i between depth 'from' and depth 'to' (both included) and
+// insert it in 'reg'. Returns false if the point was rejected at every depth, which can only
+// happen when 'to' < max_depth since the last level accepts all the points.
+bool Octree::insert(uint32_t i, int from, int to, Registry& reg)
+{
+  Registry::iterator it;
+
+  double px, py, pz;
+  get_point(i, px, py, pz);
 
-  // Search a place to insert the point
-  int lvl = 0;
+  int lvl = from;
   int cell = 0;
   bool accepted = false;
   while (!accepted)
   {
-    Key key = get_key(x[i], y[i], z[i], lvl);
+    if (lvl > to) return false;
+
+    Key key = get_key(px, py, pz, lvl);
 
     if (lvl == max_depth)
       cell = -1; // Do not build an occupancy grid for last level. Point must be inserted anyway.
     else
-      cell = get_cell(x[i], y[i], z[i], key);
+      cell = get_cell(px, py, pz, key);
 
     //printf("Suggested key %d-%d-%d-%d in cell %d\n", key.x, key.y, key.z, key.d, cell);
 
-    it = registry.find(key);
-    if (it == registry.end())
-    {
-      //printf("Registry add key %d-%d-%d-%d\n", key.x, key.y, key.z, key.d);
-      Node node;
-      set_bbox(key, node.bbox);
-      it = registry.emplace(key, node).first;
-    }
-
-    auto it2 = it->second.occupancy.find(cell);
-    accepted = (it2 == it->second.occupancy.end()) || (lvl == max_depth);
+    it = fetch(key, reg);
+    accepted = (lvl == max_depth) || !it->second.occupancy.contains(cell);
 
     lvl++;
   }
 
-  it->second.insert(i, cell);
+  it->second.insert(i, cell, reg.arena);
 
   //if (it->first.d == 0)
   //printf("Insert point i = %lu (%.1lf, %.1lf, %.1lf) in %d-%d-%d-%d in cell %d n = %lu\n", i,  x[i], y[i], z[i], it->first.x, it->first.y, it->first.z, it->first.d, cell, it->second.point_idx.size());
@@ -164,6 +334,416 @@ bool Octree::insert(uint32_t i)
   return true;
 }
 
+// Find the octant of a given key or create it if it does not exist yet
+Registry::iterator Octree::fetch(const Key& key, Registry& reg)
+{
+  auto it = reg.find(key);
+  if (it == reg.end())
+  {
+    //printf("Registry add key %d-%d-%d-%d\n", key.x, key.y, key.z, key.d);
+    Node node;
+    set_bbox(key, node.bbox);
+    node.occupancy = Occupancy(grid_size*grid_size*grid_size);
+    it = reg.emplace(key, std::move(node)).first;
+  }
+  return it;
+}
+
+// Indexes n points that all belong to the same octant of depth 'from'. The frame remains the one
+// of the whole point cloud so the nodes built are the nodes of the whole octree below this octant.
+void Octree::build_subtree(const double* x, const double* y, const double* z, size_t n, int from)
+{
+  if (n > UINT32_MAX)
+    throw std::runtime_error("Spatial indexation is bound to 4,294 billion points");
+
+  this->x = x;
+  this->y = y;
+  this->z = z;
+  this->xyz = nullptr;
+  this->npoint = n;
+
+  registry.clear();
+  finalized = false;
+
+  for (uint32_t i = 0 ; i < n ; i++) insert(i, from, max_depth, registry);
+
+  finalize();
+}
+
+void Octree::build(int ncpu, const std::atomic<bool>* cancel)
+{
+  auto cancelled = [cancel]() { return cancel && cancel->load(); };
+
+  // The partition depth is fixed. It must not depend on the number of threads so the octree is
+  // always the same. 3 gives 512 independent subtrees, enough to balance the load on many cores
+  // even for flat ALS tiles that only occupy a single layer of octants.
+  const int depth = std::min(max_depth, 3);
+
+  if (ncpu > (int)std::thread::hardware_concurrency() && std::thread::hardware_concurrency() > 0)
+    ncpu = std::thread::hardware_concurrency();
+
+  if (ncpu <= 1 || depth == 0)
+  {
+    for (uint32_t i = 0 ; i < npoint ; i++)
+    {
+      if ((i & 0xFFFF) == 0 && cancelled()) return;
+      insert(i);
+    }
+    return;
+  }
+
+  auto parallel_for = [ncpu](size_t n, const std::function<void(int, size_t, size_t)>& f)
+  {
+    std::vector<std::thread> threads;
+    size_t chunk = (n + ncpu - 1) / ncpu;
+    for (int t = 0 ; t < ncpu ; t++)
+    {
+      size_t start = std::min(n, t * chunk);
+      size_t end = std::min(n, start + chunk);
+      threads.emplace_back(f, t, start, end);
+    }
+    for (auto& thread : threads) thread.join();
+  };
+
+  // The point i is inserted in the first octant in which its cell is free given the points 0 to
+  // i-1. The octants shallower than 'depth' are shared by all the subtrees. They are filled level
+  // by level: at a given level the points still pending are accepted if they are the first of
+  // their cell in the original order. Each thread finds the first point of each cell in its own
+  // contiguous range of points, then the candidates are validated sequentially in the original
+  // order against the occupancy of the octants. The octant and the cell of a point are packed in
+  // a single code (13 B/pt with the pending points) and the points not accepted are compacted in
+  // place for the next level.
+  std::vector<uint32_t> pending(npoint);
+  for (uint32_t i = 0 ; i < npoint ; i++) pending[i] = i;
+
+  for (int lvl = 0 ; lvl < depth ; lvl++)
+  {
+    if (cancelled()) return;
+
+    std::vector<uint64_t> codes(pending.size());
+    std::vector<char> candidate(pending.size(), 0);
+
+    parallel_for(pending.size(), [&](int, size_t start, size_t end)
+    {
+      std::unordered_set<uint64_t> seen;
+      for (size_t k = start ; k < end ; k++)
+      {
+        double px, py, pz;
+        get_point(pending[k], px, py, pz);
+        Key key = get_key(px, py, pz, lvl);
+        int cell = get_cell(px, py, pz, key);
+        codes[k] = ((uint64_t)((key.x << (2*lvl)) | (key.y << lvl) | key.z) << 32) | (uint32_t)cell;
+        candidate[k] = seen.insert(codes[k]).second;
+      }
+    });
+
+    const uint32_t mask = (1u << lvl) - 1;
+    size_t w = 0;
+    for (size_t k = 0 ; k < pending.size() ; k++)
+    {
+      if (candidate[k])
+      {
+        uint32_t octant = (uint32_t)(codes[k] >> 32);
+        int cell = (int)(uint32_t)codes[k];
+        auto it = fetch(Key(lvl, octant >> (2*lvl), (octant >> lvl) & mask, octant & mask), registry);
+        if (!it->second.occupancy.contains(cell))
+        {
+          it->second.insert(pending[k], cell, registry.arena);
+          continue;
+        }
+      }
+
+      pending[w++] = pending[k];
+    }
+
+    pending.resize(w);
+  }
+
+  // The remaining points are dispatched into the subtree they belong to, still in the original
+  // order. Each subtree is independent of the others and is built in its own registry. The result
+  // is exactly the one of the sequential insertion whatever the number of threads.
+  const int side = 1 << depth;
+  std::vector<uint16_t> subtree(pending.size());
+  parallel_for(pending.size(), [&](int, size_t start, size_t end)
+  {
+    for (size_t k = start ; k < end ; k++)
+    {
+      double px, py, pz;
+      get_point(pending[k], px, py, pz);
+      Key key = get_key(px, py, pz, depth);
+      subtree[k] = (uint16_t)((key.x * side + key.y) * side + key.z);
+    }
+  });
+
+  std::vector<std::vector<uint32_t>> buckets(side*side*side);
+  for (size_t k = 0 ; k < pending.size() ; k++) buckets[subtree[k]].push_back(pending[k]);
+  std::vector<uint16_t>().swap(subtree);
+  std::vector<uint32_t>().swap(pending);
+
+  // Larger subtrees first for a better load balancing
+  std::vector<size_t> order(buckets.size());
+  for (size_t i = 0 ; i < order.size() ; i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+  std::vector<Registry> registries(ncpu);
+  std::atomic<size_t> next(0);
+
+  parallel_for(ncpu, [&](int id, size_t, size_t)
+  {
+    size_t k;
+    while ((k = next++) < order.size() && !cancelled())
+    {
+      std::vector<uint32_t>& bucket = buckets[order[k]];
+      for (auto i : bucket) insert(i, depth, max_depth, registries[id]);
+      std::vector<uint32_t>().swap(bucket);
+    }
+  });
+
+  // Subtrees are disjoint so merging only moves the nodes
+  for (auto& reg : registries) registry.merge(reg);
+}
+
+// Stable LSD radix sort of the codes on their 'nbits' least significant bits. The indices are
+// moved along with the codes.
+static void radix_sort(std::vector<uint64_t>& codes, std::vector<uint32_t>& idx, int nbits)
+{
+  std::vector<uint64_t> codes_tmp(codes.size());
+  std::vector<uint32_t> idx_tmp(idx.size());
+
+  for (int shift = 0 ; shift < nbits ; shift += 8)
+  {
+    size_t count[257] = {0};
+    for (auto code : codes) count[((code >> shift) & 0xFF) + 1]++;
+
+    // All the codes share the same byte: nothing to do for this pass
+    bool skip = false;
+    for (int k = 1 ; k <= 256 ; k++) if (count[k] == codes.size()) skip = true;
+    if (skip) continue;
+
+    for (int k = 0 ; k < 256 ; k++) count[k+1] += count[k];
+
+    for (size_t i = 0 ; i < codes.size() ; i++)
+    {
+      size_t pos = count[(codes[i] >> shift) & 0xFF]++;
+      codes_tmp[pos] = codes[i];
+      idx_tmp[pos] = idx[i];
+    }
+
+    codes.swap(codes_tmp);
+    idx.swap(idx_tmp);
+  }
+}
+
+// Bulk alternative to the incremental insertion. Every point is quantized once on a grid as fine
+// as the occupancy grid of the deepest octants and sorted by Morton code. Octants and cells are
+// then contiguous runs of codes sharing the same prefix. At a given level the point accepted in a
+// cell is the first point of the cell, in the original order, that was not accepted at a
+// shallower level: this is exactly what the incremental insertion does so both builders produce
+// the same octree up to the floating point rounding at the boundaries of the cells.
+void Octree::build_sorted(const std::atomic<bool>* cancel)
+{
+  auto cancelled = [cancel]() { return cancel && cancel->load(); };
+
+  int gbits = 0;
+  while ((1 << gbits) < grid_size) gbits++;
+
+  // The bits per axis needed to address a cell of depth max_depth-1 and an octant of max_depth
+  int bits = (max_depth > 0) ? max_depth - 1 + gbits : 0;
+
+  if ((1 << gbits) != grid_size || bits > 21)
+  {
+    build(1, cancel);
+    return;
+  }
+
+  uint32_t side = 1u << bits;
+  double res = (xmax - xmin) / side;
+
+  auto quantize = [side, res](double v, double vmin) -> uint32_t
+  {
+    int64_t q = (int64_t)std::floor((v - vmin) / res);
+    return (uint32_t)std::clamp<int64_t>(q, 0, side - 1);
+  };
+
+  std::vector<uint64_t> codes(npoint);
+  std::vector<uint32_t> idx(npoint);
+  for (uint32_t i = 0 ; i < npoint ; i++)
+  {
+    double px, py, pz;
+    get_point(i, px, py, pz);
+    codes[i] = morton_encode(quantize(px, xmin), quantize(py, ymin), quantize(pz, zmin));
+    idx[i] = i;
+  }
+
+  if (cancelled()) return;
+  radix_sort(codes, idx, 3*bits);
+
+  for (int lvl = 0 ; lvl <= max_depth ; lvl++)
+  {
+    if (cancelled()) return;
+
+    bool last = lvl == max_depth;
+    int cell_shift = last ? 0 : 3*(bits - lvl - gbits);
+    int node_shift = 3*(bits - lvl);
+
+    Registry::iterator it = registry.end();
+    uint64_t current = UINT64_MAX;
+
+    auto accept = [&](size_t k)
+    {
+      uint64_t prefix = codes[k] >> node_shift;
+      if (prefix != current)
+      {
+        uint32_t kx, ky, kz;
+        morton_decode(prefix, kx, ky, kz);
+        it = fetch(Key(lvl, kx, ky, kz), registry);
+        current = prefix;
+      }
+      it->second.insert(idx[k], -1, registry.arena);
+    };
+
+    // Points that are not accepted are compacted at the beginning of the arrays for the next
+    // level. The order is preserved so the runs remain sorted.
+    size_t n = codes.size();
+    size_t w = 0;
+    size_t start = 0;
+    while (start < n)
+    {
+      uint64_t cell = codes[start] >> cell_shift;
+      size_t end = start + 1;
+      while (end < n && (codes[end] >> cell_shift) == cell) end++;
+
+      size_t first = start;
+      for (size_t k = start + 1 ; k < end ; k++) if (idx[k] < idx[first]) first = k;
+
+      for (size_t k = start ; k < end ; k++)
+      {
+        if (last || k == first)
+        {
+          accept(k);
+        }
+        else
+        {
+          codes[w] = codes[k];
+          idx[w] = idx[k];
+          w++;
+        }
+      }
+
+      start = end;
+    }
+
+    codes.resize(w);
+    idx.resize(w);
+  }
+
+}
+
+// Level by level and in Morton order within a level
+static bool octree_order(const Key& a, const Key& b)
+{
+  if (a.d != b.d) return a.d < b.d;
+  return morton_encode(a.x, a.y, a.z) < morton_encode(b.x, b.y, b.z);
+}
+
+// Once the index is built the points of all the nodes are concatenated in a single array sorted
+// level by level and in Morton order within a level. Each node becomes a range of this array. The
+// occupancy grids are only needed to insert new points and are released. No point can be inserted
+// after that.
+void Octree::finalize()
+{
+  if (finalized) return;
+
+  std::vector<std::pair<Key, Node*>> nodes;
+  nodes.reserve(registry.size());
+  for (auto& pair : registry) nodes.emplace_back(pair.first, &pair.second);
+
+  std::sort(nodes.begin(), nodes.end(), [](const std::pair<Key, Node*>& a, const std::pair<Key, Node*>& b)
+  {
+    return octree_order(a.first, b.first);
+  });
+
+  order.clear();
+  order.reserve(npoint);
+  for (auto& pair : nodes)
+  {
+    Node& node = *pair.second;
+    node.offset = order.size();
+    node.count = node.point_idx.size();
+    // Ascending indices: the point cloud is read forward and the indices compress well
+    order.resize(node.offset + node.count);
+    node.point_idx.copy(order.data() + node.offset);
+    std::sort(order.begin() + node.offset, order.end());
+    node.point_idx.clear();
+    node.occupancy.clear();
+  }
+
+  // The point lists are now in 'order'
+  registry.arena.clear();
+
+  order_data = order.data();
+  finalized = true;
+
+  freeze();
+}
+
+// Copies the hierarchy of the finalized registry in an array of compact nodes in the octree
+// order. The children of a node are found with its child mask and the index of its first child
+// instead of hashing their keys. The low 3 bits of the Morton code of a key are the direction of
+// the key in its parent so the children of a node are contiguous in this order and sorted as in
+// Key::get_children(). A node whose parent does not exist cannot be reached, as in the registry.
+// The nodes of the registry hold the bounding box and the build state of each node and are no
+// longer needed: the registry is released. If it is empty the hierarchy is already filled (see
+// read()) and is only sorted and linked.
+void Octree::freeze()
+{
+  if (registry.size() > 0)
+  {
+    hierarchy.clear();
+    hierarchy.reserve(registry.size());
+    for (const auto& pair : registry)
+      hierarchy.push_back({pair.first, pair.second.offset, pair.second.count, 0, 0});
+    registry.clear();
+  }
+
+  std::sort(hierarchy.begin(), hierarchy.end(), [](const FrozenNode& a, const FrozenNode& b)
+  {
+    return octree_order(a.key, b.key);
+  });
+
+  for (auto& node : hierarchy)
+  {
+    node.first_child = 0;
+    node.children = 0;
+  }
+
+  // The parents of the nodes of a level are in the same order than the nodes
+  size_t parent = 0;
+  for (size_t i = 0 ; i < hierarchy.size() ; i++)
+  {
+    const Key& key = hierarchy[i].key;
+    if (key.d == 0) continue;
+
+    Key parent_key = key.get_parent();
+    while (parent < i && octree_order(hierarchy[parent].key, parent_key)) parent++;
+    if (parent == i || hierarchy[parent].key != parent_key) continue;
+
+    FrozenNode& node = hierarchy[parent];
+    if (node.children == 0) node.first_child = i;
+    node.children |= 1 << ((key.x & 1) | ((key.y & 1) << 1) | ((key.z & 1) << 2));
+  }
+}
+
+size_t Octree::memory_usage() const
+{
+  size_t bytes = registry.memory();
+  bytes += order.capacity() * sizeof(uint32_t);
+  bytes += hierarchy.capacity() * sizeof(FrozenNode);
+  for (const auto& pair : registry)
+    bytes += pair.second.occupancy.memory();
+  return bytes;
+}
+
 Key Octree::get_key(double x, double y, double z, int depth) const
 {
   int grid_size = 1 << depth;  // 2^depth
@@ -180,7 +760,7 @@ Key Octree::get_key(double x, double y, double z, int depth) const
   return Key(depth, xi, yi, zi);
 }
 
-void Octree::set_bbox(const Key& key, double* bb)
+void Octree::set_bbox(const Key& key, double* bb) const
 {
   double size = get_halfsize()*2;
   double res  = size / (1 << key.d);
@@ -222,88 +802,331 @@ int Octree::get_cell(double x, double y, double z, const Key& key) const
   return zi * grid_size * grid_size + yi * grid_size + xi;
 }
 
-const std::string FILE_SIGNATURE = "HNOF";
-const int FILE_VERSION_MAJOR = 1;
-const int FILE_VERSION_MINOR = 0;
-
-// Write function
-void Octree::write(const std::string& filename)
+// Writes the index. If the points are provided their coordinates and attributes are written in the
+// octree order after the index so the file is self-contained.
+void Octree::write(const std::string& filename, const PointCloud* points, bool compress)
 {
-  printf("write\n");
+  finalize();
+
   std::ofstream outFile(filename, std::ios::binary);
 
   if (!outFile)
     throw std::runtime_error("Failed to open file for writing: " + filename);
 
-  // Write file signature
-  outFile.write(FILE_SIGNATURE.c_str(), FILE_SIGNATURE.size());
+  // Nodes in the octree order i.e. sorted by offset
+  std::vector<HnofNode> nodes;
+  nodes.reserve(hierarchy.size());
+  for (const auto& node : hierarchy)
+    nodes.push_back({node.key.d, node.key.x, node.key.y, node.key.z, node.offset, node.count});
+  std::sort(nodes.begin(), nodes.end(), [](const HnofNode& a, const HnofNode& b) { return a.offset < b.offset; });
+
+  HnofHeader header = {};
+  std::copy(HNOF_SIGNATURE, HNOF_SIGNATURE + 4, header.signature);
+  header.version_major = HNOF_VERSION_MAJOR;
+  header.version_minor = HNOF_VERSION_MINOR;
+  header.header_size = sizeof(HnofHeader);
+  header.xmin = xmin;
+  header.ymin = ymin;
+  header.zmin = zmin;
+  header.xmax = xmax;
+  header.ymax = ymax;
+  header.zmax = zmax;
+  header.grid_size = grid_size;
+  header.max_depth = max_depth;
+  header.npoints = npoint;
+  header.nnodes = nodes.size();
+  header.node_offset = hnof_align(sizeof(HnofHeader));
+  header.index_offset = hnof_align(header.node_offset + nodes.size() * sizeof(HnofNode));
+  header.fingerprint = fingerprint;
+
+  // Compressed payload: offsets of the stream of each node followed by the streams
+  std::vector<uint64_t> streams_offset;
+  std::vector<uint8_t> streams;
+  if (compress)
+  {
+    const uint32_t* order = get_order();
+    streams_offset.reserve(nodes.size() + 1);
+    for (const auto& n : nodes)
+    {
+      streams_offset.push_back(streams.size());
+      bitpack_encode(order + n.offset, n.count, streams);
+    }
+    streams_offset.push_back(streams.size());
+    streams.resize(streams.size() + BITPACK_PADDING, 0);
+    header.flags |= HNOF_COMPRESSED;
+  }
+
+  uint64_t index_size = (compress) ? streams_offset.size() * sizeof(uint64_t) + streams.size() : (uint64_t)npoint * sizeof(uint32_t);
 
-  // Write file version
-  outFile.write(reinterpret_cast<const char*>(&FILE_VERSION_MAJOR), 4);
-  outFile.write(reinterpret_cast<const char*>(&FILE_VERSION_MINOR), 4);
+  HnofData desc = {};
+  if (points)
+  {
+    desc.bbox[0] = desc.bbox[1] = desc.bbox[2] = std::numeric_limits<double>::infinity();
+    desc.bbox[3] = desc.bbox[4] = desc.bbox[5] = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0 ; i < points->npoints ; i++)
+    {
+      desc.bbox[0] = std::min(desc.bbox[0], points->get_x(i));
+      desc.bbox[1] = std::min(desc.bbox[1], points->get_y(i));
+      desc.bbox[2] = std::min(desc.bbox[2], points->get_z(i));
+      desc.bbox[3] = std::max(desc.bbox[3], points->get_x(i));
+      desc.bbox[4] = std::max(desc.bbox[4], points->get_y(i));
+      desc.bbox[5] = std::max(desc.bbox[5], points->get_z(i));
+    }
 
-  // Write the bounding box
-  outFile.write(reinterpret_cast<const char*>(&xmin), 8);
-  outFile.write(reinterpret_cast<const char*>(&ymin), 8);
-  outFile.write(reinterpret_cast<const char*>(&zmin), 8);
-  outFile.write(reinterpret_cast<const char*>(&xmax), 8);
-  outFile.write(reinterpret_cast<const char*>(&ymax), 8);
-  outFile.write(reinterpret_cast<const char*>(&zmax), 8);
+    double extent = MAX(desc.bbox[3] - desc.bbox[0], desc.bbox[4] - desc.bbox[1], desc.bbox[5] - desc.bbox[2]);
+    double scale = PointCloud::quantization(extent);
 
-  // Write the grid spacing
-  outFile.write(reinterpret_cast<const char*>(&zmax), 8);
+    for (int k = 0 ; k < 3 ; k++)
+    {
+      desc.scale[k] = scale;
+      desc.offset[k] = desc.bbox[k];
+    }
 
-  // Write the size of the unordered_map
-  std::uint64_t mapSize = registry.size(); // Use uint64_t for large sizes
-  outFile.write(reinterpret_cast<const char*>(&mapSize), 8);
+    header.flags |= HNOF_DATA;
+    header.data_offset = hnof_align(header.index_offset + index_size);
 
-  // Iterate through each key-value pair
-  for (const auto& pair : registry)
+    uint64_t next = header.data_offset + sizeof(HnofData);
+    desc.xyz_offset = hnof_align(next);
+    next = desc.xyz_offset + (uint64_t)npoint * 3 * sizeof(int32_t);
+    if (points->has_rgb())
+    {
+      desc.rgb_offset = hnof_align(next);
+      next = desc.rgb_offset + (uint64_t)npoint * 3 * sizeof(uint16_t);
+    }
+    if (points->has_intensity())
+    {
+      desc.intensity_offset = hnof_align(next);
+      next = desc.intensity_offset + (uint64_t)npoint * sizeof(uint16_t);
+    }
+    if (points->has_classification())
+    {
+      desc.classification_offset = hnof_align(next);
+    }
+  }
+
+  const char padding[HNOF_ALIGNMENT] = {0};
+  auto pad_to = [&outFile, &padding](uint64_t offset)
   {
-    // Write each int of Key
-    outFile.write(reinterpret_cast<const char*>(&pair.first.d), 4);
-    outFile.write(reinterpret_cast<const char*>(&pair.first.x), 4);
-    outFile.write(reinterpret_cast<const char*>(&pair.first.y), 4);
-    outFile.write(reinterpret_cast<const char*>(&pair.first.z), 4);
+    uint64_t pos = outFile.tellp();
+    if (offset > pos) outFile.write(padding, offset - pos);
+  };
+
+  outFile.write(reinterpret_cast<const char*>(&header), sizeof(HnofHeader));
+  pad_to(header.node_offset);
+  outFile.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(HnofNode));
+  pad_to(header.index_offset);
+  if (compress)
+  {
+    outFile.write(reinterpret_cast<const char*>(streams_offset.data()), streams_offset.size() * sizeof(uint64_t));
+    outFile.write(reinterpret_cast<const char*>(streams.data()), streams.size());
+  }
+  else
+  {
+    outFile.write(reinterpret_cast<const char*>(get_order()), (uint64_t)npoint * sizeof(uint32_t));
+  }
+
+  if (points)
+  {
+    const uint32_t* order = get_order();
+
+    // Writes one attribute of every point in the octree order by chunks of 1M points
+    auto write_section = [&](uint64_t offset, size_t size, const std::function<void(size_t, char*)>& encode)
+    {
+      pad_to(offset);
+      std::vector<char> buffer;
+      const size_t chunk = 1000000;
+      for (size_t start = 0 ; start < npoint ; start += chunk)
+      {
+        size_t n = std::min<size_t>(chunk, npoint - start);
+        buffer.resize(n * size);
+        for (size_t k = 0 ; k < n ; k++)
+        {
+          size_t i = (points->reordered) ? start + k : order[start + k];
+          encode(i, &buffer[k * size]);
+        }
+        outFile.write(buffer.data(), buffer.size());
+      }
+    };
+
+    pad_to(header.data_offset);
+    outFile.write(reinterpret_cast<const char*>(&desc), sizeof(HnofData));
+
+    write_section(desc.xyz_offset, 3 * sizeof(int32_t), [&](size_t i, char* out)
+    {
+      int32_t xyz[3];
+      xyz[0] = (int32_t)std::round((points->get_x(i) - desc.offset[0]) / desc.scale[0]);
+      xyz[1] = (int32_t)std::round((points->get_y(i) - desc.offset[1]) / desc.scale[1]);
+      xyz[2] = (int32_t)std::round((points->get_z(i) - desc.offset[2]) / desc.scale[2]);
+      std::memcpy(out, xyz, sizeof(xyz));
+    });
+
+    if (desc.rgb_offset)
+    {
+      write_section(desc.rgb_offset, 3 * sizeof(uint16_t), [&](size_t i, char* out)
+      {
+        // 8 bits colours are stored on 16 bits as in LAS files (255 -> 65535)
+        uint32_t c = points->rgba[i];
+        uint16_t rgb[3] = { (uint16_t)((c & 0xFF) * 257), (uint16_t)(((c >> 8) & 0xFF) * 257), (uint16_t)(((c >> 16) & 0xFF) * 257) };
+        std::memcpy(out, rgb, sizeof(rgb));
+      });
+    }
 
-    // Write the size of the vector<int> (octant)
-    size_t vectorSize = pair.second.point_idx.size();
-    outFile.write(reinterpret_cast<const char*>(&vectorSize), sizeof(size_t));
+    if (desc.intensity_offset)
+    {
+      write_section(desc.intensity_offset, sizeof(uint16_t), [&](size_t i, char* out)
+      {
+        std::memcpy(out, &points->intensity[i], sizeof(uint16_t));
+      });
+    }
 
-    // Write the vector<int> data
-    outFile.write(reinterpret_cast<const char*>(pair.second.point_idx.data()), vectorSize * 4);
+    if (desc.classification_offset)
+    {
+      write_section(desc.classification_offset, sizeof(uint8_t), [&](size_t i, char* out)
+      {
+        *out = (char)points->classification[i];
+      });
+    }
   }
 
+  if (!outFile)
+    throw std::runtime_error("Failed to write file: " + filename);
+
   outFile.close();
 }
 
-// Read function
+// Maps the file and uses the index payload in place. Only the node table is copied.
 bool Octree::read(const std::string& filename)
 {
-  printf("read\n");
+  MappedFile map(filename);
 
-  std::ifstream inFile(filename, std::ios::binary);
+  const uint8_t* data = map.get_data();
+  size_t size = map.get_size();
 
-  if (!inFile)
-    throw std::runtime_error("Failed to open file for reading: " + filename);
-
-  // Read and validate file signature
-  char signature[FILE_SIGNATURE.size()];
-  inFile.read(signature, FILE_SIGNATURE.size());
-  if (std::string(signature, FILE_SIGNATURE.size()) != FILE_SIGNATURE)
+  if (size < 12 || !std::equal(HNOF_SIGNATURE, HNOF_SIGNATURE + 4, reinterpret_cast<const char*>(data)))
     throw std::runtime_error("Invalid file signature.");
 
-  // Read and validate file version
-  int fileVersionMajor;
-  inFile.read(reinterpret_cast<char*>(&fileVersionMajor), 4);
-  int fileVersionMinor;
-  inFile.read(reinterpret_cast<char*>(&fileVersionMinor), 4);
-  if (fileVersionMajor != 1 || fileVersionMinor != 0)
+  uint32_t fileVersionMajor, fileVersionMinor;
+  std::memcpy(&fileVersionMajor, data + 4, 4);
+  std::memcpy(&fileVersionMinor, data + 8, 4);
+
+  if (fileVersionMajor == 1 && fileVersionMinor == 0)
+    return read_v1(filename);
+
+  if (fileVersionMajor != HNOF_VERSION_MAJOR)
     throw std::runtime_error(std::string("Unsupported file version: ") + std::to_string(fileVersionMajor) + "." + std::to_string(fileVersionMinor));
 
-  // Read the size of the unordered_map
-  uint64_t mapSize;
-  inFile.read(reinterpret_cast<char*>(&mapSize), 8);
+  if (size < sizeof(HnofHeader))
+    throw std::runtime_error("Truncated file: " + filename);
+
+  HnofHeader header;
+  std::memcpy(&header, data, sizeof(HnofHeader));
+
+  bool compressed = header.flags & HNOF_COMPRESSED;
+  bool orderless = header.flags & HNOF_ORDERLESS;
+  uint64_t index_size = (compressed) ? (header.nnodes + 1) * sizeof(uint64_t) : header.npoints * sizeof(uint32_t);
+  if (orderless) index_size = 0;
+
+  if (orderless && !(header.flags & HNOF_DATA))
+    throw std::runtime_error("Corrupted file: " + filename);
+
+  if ((header.npoints > UINT32_MAX && !orderless) ||
+      header.node_offset + header.nnodes * sizeof(HnofNode) > size ||
+      header.index_offset + index_size > size ||
+      header.index_offset % sizeof(uint64_t) != 0)
+    throw std::runtime_error("Truncated file: " + filename);
+
+  hnof_flags = header.flags;
+  fingerprint = header.fingerprint;
+  hnof_data = HnofData();
+  if (has_data())
+  {
+    if (header.data_offset + sizeof(HnofData) > size)
+      throw std::runtime_error("Truncated file: " + filename);
+
+    std::memcpy(&hnof_data, data + header.data_offset, sizeof(HnofData));
+
+    if (hnof_data.xyz_offset + header.npoints * 3 * sizeof(int32_t) > size ||
+        hnof_data.rgb_offset + (hnof_data.rgb_offset ? header.npoints * 3 * sizeof(uint16_t) : 0) > size ||
+        hnof_data.intensity_offset + (hnof_data.intensity_offset ? header.npoints * sizeof(uint16_t) : 0) > size ||
+        hnof_data.classification_offset + (hnof_data.classification_offset ? header.npoints : 0) > size)
+      throw std::runtime_error("Truncated file: " + filename);
+  }
+
+  xmin = header.xmin;
+  ymin = header.ymin;
+  zmin = header.zmin;
+  xmax = header.xmax;
+  ymax = header.ymax;
+  zmax = header.zmax;
+  grid_size = header.grid_size;
+  max_depth = header.max_depth;
+  npoint = header.npoints;
+  x = y = z = nullptr;
+  xyz = nullptr;
+
+  // The nodes are read directly in the frozen hierarchy. There is no registry to build.
+  registry.clear();
+  hierarchy.clear();
+  hierarchy.reserve(header.nnodes);
+
+  const HnofNode* nodes = reinterpret_cast<const HnofNode*>(data + header.node_offset);
+  for (uint64_t i = 0 ; i < header.nnodes ; i++)
+  {
+    const HnofNode& n = nodes[i];
+    if (n.offset + n.count > header.npoints)
+      throw std::runtime_error("Corrupted file: " + filename);
+
+    hierarchy.push_back({Key(n.d, n.x, n.y, n.z), n.offset, n.count, 0, 0});
+  }
+
+  if (orderless)
+  {
+    // The points are only available from the data sections
+    std::vector<uint32_t>().swap(order);
+    order_data = nullptr;
+  }
+  else if (compressed)
+  {
+    // The streams are decoded in memory. The nodes are stored in the octree order.
+    const uint64_t* streams_offset = reinterpret_cast<const uint64_t*>(data + header.index_offset);
+    const uint8_t* streams = data + header.index_offset + index_size;
+    uint64_t streams_size = size - (header.index_offset + index_size);
+
+    order.resize(header.npoints);
+    for (uint64_t i = 0 ; i < header.nnodes ; i++)
+    {
+      uint64_t begin = streams_offset[i];
+      uint64_t end = streams_offset[i+1];
+      if (begin > end || end + BITPACK_PADDING > streams_size ||
+          (nodes[i].count > 0 && bitpack_decode(streams + begin, end - begin, nodes[i].count, &order[nodes[i].offset]) == 0))
+        throw std::runtime_error("Corrupted file: " + filename);
+    }
+
+    order_data = order.data();
+  }
+  else
+  {
+    std::vector<uint32_t>().swap(order);
+    order_data = reinterpret_cast<const uint32_t*>(data + header.index_offset);
+    file = std::move(map);
+  }
+
+  finalized = true;
+  freeze();
+
+  return true;
+}
+
+// Legacy format. The header is: signature, version, bbox, 8 unused bytes, number of nodes. Each
+// node is a key followed by the number of points on 8 bytes and the indices of the points.
+bool Octree::read_v1(const std::string& filename)
+{
+  std::ifstream inFile(filename, std::ios::binary);
+
+  if (!inFile)
+    throw std::runtime_error("Failed to open file for reading: " + filename);
+
+  inFile.seekg(12);
 
   // Read the bbox
   inFile.read(reinterpret_cast<char*>(&xmin), 8);
@@ -313,16 +1136,21 @@ bool Octree::read(const std::string& filename)
   inFile.read(reinterpret_cast<char*>(&ymax), 8);
   inFile.read(reinterpret_cast<char*>(&zmax), 8);
 
-  // Read the grid spacing
-  inFile.read(reinterpret_cast<char*>(&grid_size), 4);
+  // Unused slot (the grid spacing was not written)
+  inFile.seekg(8, std::ios::cur);
+  grid_size = 128;
+
+  // Read the number of nodes
+  uint64_t mapSize;
+  inFile.read(reinterpret_cast<char*>(&mapSize), 8);
 
   // Clear the existing map
   registry.clear();
 
   // Read each key-value pair
-  npoint = 0;
+  uint64_t n = 0;
   max_depth = 0;
-  for (size_t i = 0; i < mapSize; ++i)
+  for (size_t i = 0; i < mapSize && inFile; ++i)
   {
     // Read Key (4 integers)
     Key key;
@@ -334,19 +1162,35 @@ bool Octree::read(const std::string& filename)
     uint64_t vectorSize;
     inFile.read(reinterpret_cast<char*>(&vectorSize), 8);
 
-    npoint += vectorSize;
+    n += vectorSize;
+    if (n > UINT32_MAX)
+      throw std::runtime_error("Corrupted file: " + filename);
 
     Node octant;
     set_bbox(key, octant.bbox);
-    octant.point_idx.resize(vectorSize);
 
     // Read the vector<int> data
-    inFile.read(reinterpret_cast<char*>(&(octant.point_idx[0])), vectorSize * 4);
+    std::vector<uint32_t> idx(vectorSize);
+    inFile.read(reinterpret_cast<char*>(idx.data()), vectorSize * 4);
+    for (auto i : idx) octant.insert(i, -1, registry.arena);
 
-    // Insert the pair into the unordered_map
+    // Insert the node in the registry
     registry.emplace(key, std::move(octant));
   }
 
+  if (!inFile)
+    throw std::runtime_error("Truncated file: " + filename);
+
   inFile.close();
+
+  npoint = n;
+  x = y = z = nullptr;
+  xyz = nullptr;
+  hnof_flags = 0;
+  fingerprint = 0;
+  file.close();
+  finalized = false;
+  finalize();
+
   return true;
 }
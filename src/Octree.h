@@ -4,10 +4,17 @@
 #include <cstddef>
 #include <cstdint>
 #include <array>
+#include <atomic>
 #include <string>
 #include <vector>
-#include <unordered_set>
-#include <unordered_map>
+#include <memory>
+#include <utility>
+
+#include "Occupancy.h"
+#include "PointList.h"
+#include "MappedFile.h"
+#include "PointCloud.h"
+#include "Hnof.h"
 
 #define MAX(a, b, c) ((a) <= (b)? (b) <= (c)? (c) : (b) : (a) <= (c)? (c) : (a))
 #define INFD std::numeric_limits<double>::infinity();
@@ -27,18 +34,6 @@ struct Key
   int32_t z;
 };
 
-struct KeyHasher
-{
-  // PDAL hash method copied
-  size_t operator()(const Key &k) const
-  {
-    std::hash<size_t> h;
-    size_t k1 = ((size_t)k.d << 32) | k.x;
-    size_t k2 = ((size_t)k.y << 32) | k.z;
-    return h(k1) ^ (h(k2) << 1);
-  }
-};
-
 inline bool operator==(const Key& a, const Key& b) { return a.d == b.d && a.x == b.x && a.y == b.y && a.z == b.z; }
 inline bool operator!=(const Key& a, const Key& b) { return !(a == b); }
 inline bool operator<(const Key& a, const Key& b)
@@ -57,22 +52,116 @@ inline bool operator<(const Key& a, const Key& b)
 struct Node : public Key
 {
   Node();
-  void insert(size_t idx, uint32_t cell);
-  size_t npoints() const {return point_idx.size(); };
+  void insert(size_t idx, int cell, PointArena& arena);
+  size_t npoints() const {return count; };
 
   // Bounding box of the entry
   double bbox[4];
   float screen_size;
 
-  std::vector<uint32_t> point_idx;
-  std::unordered_set<uint32_t> occupancy;
+  // Range of the points of the node in the octree order (see Octree::finalize())
+  uint64_t offset;
+  uint64_t count;
+
+  // Only during the build
+  PointList point_idx;
+  Occupancy occupancy;
+};
+
+// Nodes of the octree by key. The keys are packed in a 64-bit locational code (a 1 followed by the
+// 3*d bits of the Morton code of the key, so up to depth 21) stored in an open addressing hash
+// table with linear probing. The nodes are stored by chunks in the order of insertion and are
+// never moved: references and iterators remain valid when the registry grows. Nodes cannot be
+// erased. The point lists of the nodes are allocated in the arena of the registry.
+class Registry
+{
+public:
+  typedef std::pair<Key, Node> value_type;
+
+private:
+  static const int CHUNK_SHIFT = 8;
+  static const size_t CHUNK_MASK = (1 << CHUNK_SHIFT) - 1;
+  typedef std::vector<std::unique_ptr<value_type[]>> Chunks;
+
+  template<typename Value, typename Storage>
+  class Iterator
+  {
+  public:
+    Iterator() : chunks(nullptr), i(0) {};
+    Iterator(Storage* chunks, size_t i) : chunks(chunks), i(i) {};
+    Value& operator*() const { return (*chunks)[i >> CHUNK_SHIFT][i & CHUNK_MASK]; };
+    Value* operator->() const { return &**this; };
+    Iterator& operator++() { i++; return *this; };
+    bool operator==(const Iterator& other) const { return i == other.i; };
+    bool operator!=(const Iterator& other) const { return i != other.i; };
+
+  private:
+    Storage* chunks;
+    size_t i;
+  };
+
+public:
+  typedef Iterator<value_type, Chunks> iterator;
+  typedef Iterator<const value_type, const Chunks> const_iterator;
+
+  Registry() : count(0), log2cap(0) {};
+
+  iterator begin() { return iterator(&chunks, 0); };
+  iterator end() { return iterator(&chunks, count); };
+  const_iterator begin() const { return const_iterator(&chunks, 0); };
+  const_iterator end() const { return const_iterator(&chunks, count); };
+  size_t size() const { return count; };
+
+  iterator find(const Key& key);
+  const_iterator find(const Key& key) const;
+  std::pair<iterator, bool> emplace(const Key& key, Node&& node);
+  void merge(Registry& other);
+  void reserve(size_t n);
+  void clear();
+  size_t memory() const;
+
+  PointArena arena;
+
+private:
+  struct Slot
+  {
+    uint64_t code;
+    uint64_t index;
+  };
+
+  static const uint64_t EMPTY = 0;
+
+  static uint64_t encode(const Key& key);
+  size_t probe(uint64_t code) const;
+  void rehash(size_t capacity);
+
+  Chunks chunks;
+  std::vector<Slot> table;
+  size_t count;
+  int log2cap;
+};
+
+// Node of the frozen hierarchy (see Octree::freeze()). The nodes are stored level by level and in
+// Morton order within a level, so the children of a node are contiguous and in the order of
+// Key::get_children(). Child k exists if bit k of 'children' is set. The existing children are
+// the nodes first_child, first_child + 1, etc. The points of the node are the range 'offset',
+// 'count' of the octree order.
+struct FrozenNode
+{
+  Key key;
+  uint64_t offset;
+  uint64_t count;
+  uint32_t first_child;
+  uint8_t children;
 };
 
 class Octree
 {
 public:
-  Octree() = default;
-  Octree(double* x, double* y, double* z, size_t n);
+  Octree() : x(nullptr), y(nullptr), z(nullptr), xyz(nullptr), scale{1, 1, 1}, offset{0, 0, 0}, npoint(0), max_depth(0), grid_size(128), finalized(false), order_data(nullptr), fingerprint(0), hnof_flags(0), hnof_data() {};
+  Octree(const double* x, const double* y, const double* z, size_t n);
+  Octree(const PointCloud& points);
+  Octree(const double* bbox, uint64_t n);
   Key get_key(double x, double y, double z, int depth) const;
   int get_cell(double x, double y, double z, const Key& key) const;
   inline int get_max_depth() const { return max_depth; };
@@ -87,24 +176,63 @@ public:
   inline double get_xmax() const { return xmax; };
   inline double get_ymax() const { return ymax; };
   inline double get_zmax() const { return zmax; };
-  inline uint32_t get_npoints() const { return npoint; };
+  inline uint64_t get_npoints() const { return npoint; };
   inline int get_gridsize() const { return grid_size; };
-  void set_bbox(const Key& key, double* bb);
+  inline bool is_finalized() const { return finalized; };
+  inline bool is_frozen() const { return finalized && !hierarchy.empty(); };
+  inline const std::vector<FrozenNode>& get_hierarchy() const { return hierarchy; };
+  inline uint64_t get_fingerprint() const { return fingerprint; };
+  inline void set_fingerprint(uint64_t fp) { fingerprint = fp; };
+  inline bool has_data() const { return (hnof_flags & HNOF_DATA) != 0; };
+  inline const HnofData& get_data() const { return hnof_data; };
+  inline const uint32_t* get_order() const { return order_data; };
+  inline void release_order() { std::vector<uint32_t>().swap(order); file.close(); order_data = nullptr; };
+  void set_bbox(const Key& key, double* bb) const;
   inline void set_gridsize(int32_t size) { if (size > 2) grid_size = size; };
-  void write(const std::string& filename);
+  void write(const std::string& filename, const PointCloud* points = nullptr, bool compress = false);
   bool read(const std::string& filename);
+  bool read_v1(const std::string& filename);
 
   bool insert(uint32_t i);
-  std::unordered_map<Key, Node, KeyHasher> registry;
+  void build(int ncpu = 1, const std::atomic<bool>* cancel = nullptr);
+  void build_sorted(const std::atomic<bool>* cancel = nullptr);
+  void build_subtree(const double* x, const double* y, const double* z, size_t n, int from);
+  void finalize();
+  void freeze();
+  size_t memory_usage() const;
+  Registry registry;
 
 private:
+  void init_frame();
   void compute_max_depth(size_t npts, size_t max_points_per_octant);
+  bool insert(uint32_t i, int from, int to, Registry& reg);
+  Registry::iterator fetch(const Key& key, Registry& reg);
+
+  void get_point(size_t i, double& px, double& py, double& pz) const
+  {
+    if (xyz)
+    {
+      px = xyz[3*i] * scale[0] + offset[0];
+      py = xyz[3*i+1] * scale[1] + offset[1];
+      pz = xyz[3*i+2] * scale[2] + offset[2];
+    }
+    else
+    {
+      px = x[i];
+      py = y[i];
+      pz = z[i];
+    }
+  };
 
 private:
-  double* x;
-  double* y;
-  double* z;
-  uint32_t npoint;
+  // Points indexed, either doubles or integers (see PointCloud)
+  const double* x;
+  const double* y;
+  const double* z;
+  const int32_t* xyz;
+  double scale[3];
+  double offset[3];
+  uint64_t npoint;
 
   double xmin;
   double ymin;
@@ -115,6 +243,23 @@ private:
 
   int32_t max_depth;
   int32_t grid_size;
+
+  // Indices of the points sorted in the octree order. Either owned or mapped from a file.
+  bool finalized;
+  std::vector<uint32_t> order;
+  MappedFile file;
+  const uint32_t* order_data;
+
+  // Read-only hierarchy once finalized, traversed without hashing. It replaces the registry,
+  // which is only used during the build.
+  std::vector<FrozenNode> hierarchy;
+
+  // Fingerprint of the point cloud (see PointCloud::fingerprint) written in and read from files
+  uint64_t fingerprint;
+
+  // Description of the points stored in the file read, if any
+  uint64_t hnof_flags;
+  HnofData hnof_data;
 };
 
 #endif
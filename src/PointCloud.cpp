@@ -0,0 +1,270 @@
+#include "PointCloud.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+PointCloud::PointCloud()
+{
+  npoints = 0;
+  reordered = false;
+  x = y = z = nullptr;
+  xyz = nullptr;
+  rgba = nullptr;
+  intensity = nullptr;
+  classification = nullptr;
+
+  for (int k = 0 ; k < 3 ; k++)
+  {
+    scale[k] = 1;
+    offset[k] = 0;
+  }
+}
+
+// Views are copied as is but pointers to the owned storage must point to the copied storage
+PointCloud::PointCloud(const PointCloud& other) : PointCloud()
+{
+  npoints = other.npoints;
+  reordered = other.reordered;
+  X = other.X; Y = other.Y; Z = other.Z;
+  XYZ = other.XYZ;
+  RGBA = other.RGBA;
+  I = other.I; C = other.C;
+
+  auto rebase = [](const auto* ptr, const auto& src, const auto& dst)
+  {
+    return (ptr != nullptr && ptr == src.data()) ? dst.data() : ptr;
+  };
+
+  x = rebase(other.x, other.X, X);
+  y = rebase(other.y, other.Y, Y);
+  z = rebase(other.z, other.Z, Z);
+  xyz = rebase(other.xyz, other.XYZ, XYZ);
+  rgba = rebase(other.rgba, other.RGBA, RGBA);
+  intensity = rebase(other.intensity, other.I, I);
+  classification = rebase(other.classification, other.C, C);
+
+  std::copy(other.scale, other.scale + 3, scale);
+  std::copy(other.offset, other.offset + 3, offset);
+}
+
+// Integer coordinates if a scale and an offset are given, doubles otherwise
+void PointCloud::allocate(size_t n, bool rgb, bool intensity, bool classification, const double* scale, const double* offset)
+{
+  npoints = n;
+  reordered = true;
+
+  if (scale && offset)
+  {
+    XYZ.resize(3*n);
+    xyz = XYZ.data();
+    std::copy(scale, scale + 3, this->scale);
+    std::copy(offset, offset + 3, this->offset);
+  }
+  else
+  {
+    X.resize(n); x = X.data();
+    Y.resize(n); y = Y.data();
+    Z.resize(n); z = Z.data();
+  }
+
+  if (rgb)
+  {
+    RGBA.resize(n);
+    rgba = RGBA.data();
+  }
+
+  if (intensity)
+  {
+    I.resize(n);
+    this->intensity = I.data();
+  }
+
+  if (classification)
+  {
+    C.resize(n);
+    this->classification = C.data();
+  }
+}
+
+// The colours of the data.frame are reduced to 8 bits if any channel exceeds 255
+void PointCloud::set_rgb(const int* r, const int* g, const int* b)
+{
+  int max = 0;
+  for (size_t i = 0 ; i < npoints ; i++) max = std::max(max, std::max(r[i], std::max(g[i], b[i])));
+  int shift = rgb_shift(max);
+
+  RGBA.resize(npoints);
+  for (size_t i = 0 ; i < npoints ; i++)
+    RGBA[i] = ::rgba(std::max(r[i], 0), std::max(g[i], 0), std::max(b[i], 0), shift);
+  rgba = RGBA.data();
+}
+
+void PointCloud::set_intensity(const int* intensity)
+{
+  I.resize(npoints);
+  for (size_t i = 0 ; i < npoints ; i++) I[i] = (uint16_t)std::clamp(intensity[i], 0, 65535);
+  this->intensity = I.data();
+}
+
+void PointCloud::set_classification(const int* classification)
+{
+  C.resize(npoints);
+  for (size_t i = 0 ; i < npoints ; i++) C[i] = (uint8_t)std::clamp(classification[i], 0, 255);
+  this->classification = C.data();
+}
+
+void PointCloud::reorder(const uint32_t* order)
+{
+  if (reordered) return;
+
+  // src may be the owned storage dst itself
+  auto permute = [this, order](const auto* src, auto& dst)
+  {
+    if (src == nullptr) return;
+    typename std::remove_reference<decltype(dst)>::type tmp(npoints);
+    for (size_t k = 0 ; k < npoints ; k++) tmp[k] = src[order[k]];
+    dst.swap(tmp);
+  };
+
+  // The coordinates are quantized at the same time. The point cloud then no longer depends on
+  // the double coordinates it was a view on, if any.
+  if (is_quantized())
+  {
+    std::vector<int32_t> tmp(3*npoints);
+    for (size_t k = 0 ; k < npoints ; k++)
+    {
+      const int32_t* p = xyz + 3*order[k];
+      tmp[3*k] = p[0];
+      tmp[3*k+1] = p[1];
+      tmp[3*k+2] = p[2];
+    }
+    XYZ.swap(tmp);
+  }
+  else
+  {
+    double bbox[6] = {0, 0, 0, 0, 0, 0};
+    if (npoints > 0)
+    {
+      bbox[0] = bbox[3] = x[0];
+      bbox[1] = bbox[4] = y[0];
+      bbox[2] = bbox[5] = z[0];
+    }
+    for (size_t i = 1 ; i < npoints ; i++)
+    {
+      bbox[0] = std::min(bbox[0], x[i]);
+      bbox[1] = std::min(bbox[1], y[i]);
+      bbox[2] = std::min(bbox[2], z[i]);
+      bbox[3] = std::max(bbox[3], x[i]);
+      bbox[4] = std::max(bbox[4], y[i]);
+      bbox[5] = std::max(bbox[5], z[i]);
+    }
+
+    double extent = std::max(std::max(bbox[3] - bbox[0], bbox[4] - bbox[1]), bbox[5] - bbox[2]);
+    for (int k = 0 ; k < 3 ; k++)
+    {
+      scale[k] = quantization(extent);
+      offset[k] = bbox[k];
+    }
+
+    XYZ.resize(3*npoints);
+    for (size_t k = 0 ; k < npoints ; k++)
+    {
+      size_t i = order[k];
+      XYZ[3*k] = (int32_t)std::round((x[i] - offset[0]) / scale[0]);
+      XYZ[3*k+1] = (int32_t)std::round((y[i] - offset[1]) / scale[1]);
+      XYZ[3*k+2] = (int32_t)std::round((z[i] - offset[2]) / scale[2]);
+    }
+
+    std::vector<double>().swap(X);
+    std::vector<double>().swap(Y);
+    std::vector<double>().swap(Z);
+    x = y = z = nullptr;
+  }
+
+  xyz = XYZ.data();
+
+  if (has_rgb())
+  {
+    permute(rgba, RGBA);
+    rgba = RGBA.data();
+  }
+
+  if (has_intensity())
+  {
+    permute(intensity, I);
+    intensity = I.data();
+  }
+
+  if (has_classification())
+  {
+    permute(classification, C);
+    classification = C.data();
+  }
+
+  reordered = true;
+}
+
+double PointCloud::quantization(double extent)
+{
+  double scale = 0.0001;
+  while (extent / scale > 2e9) scale *= 10;
+  return scale;
+}
+
+// Memory owned by the point cloud
+size_t PointCloud::memory() const
+{
+  return (X.capacity() + Y.capacity() + Z.capacity()) * sizeof(double) + XYZ.capacity() * sizeof(int32_t) +
+         RGBA.capacity() * sizeof(uint32_t) + I.capacity() * sizeof(uint16_t) + C.capacity() * sizeof(uint8_t);
+}
+
+// Cheap fingerprint of the coordinates: the number of points, the bounding box and a regular
+// sample of 4096 points. Used to recognize the spatial index of a point cloud written in a file.
+uint64_t PointCloud::fingerprint() const
+{
+  uint64_t h = 0x9E3779B97F4A7C15ULL;
+  auto mix = [&h](uint64_t v)
+  {
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 31;
+  };
+
+  auto bits = [](double v)
+  {
+    uint64_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    return u;
+  };
+
+  mix(npoints);
+  if (npoints == 0) return h;
+
+  double bbox[6] = { get_x(0), get_y(0), get_z(0), get_x(0), get_y(0), get_z(0) };
+  for (size_t i = 1 ; i < npoints ; i++)
+  {
+    bbox[0] = std::min(bbox[0], get_x(i));
+    bbox[1] = std::min(bbox[1], get_y(i));
+    bbox[2] = std::min(bbox[2], get_z(i));
+    bbox[3] = std::max(bbox[3], get_x(i));
+    bbox[4] = std::max(bbox[4], get_y(i));
+    bbox[5] = std::max(bbox[5], get_z(i));
+  }
+  for (int k = 0 ; k < 6 ; k++) mix(bits(bbox[k]));
+
+  size_t stride = std::max<size_t>(1, npoints / 4096);
+  for (size_t i = 0 ; i < npoints ; i += stride)
+  {
+    mix(bits(get_x(i)));
+    mix(bits(get_y(i)));
+    mix(bits(get_z(i)));
+  }
+  mix(bits(get_x(npoints-1)));
+  mix(bits(get_y(npoints-1)));
+  mix(bits(get_z(npoints-1)));
+
+  // 0 means no fingerprint
+  return (h == 0) ? 1 : h;
+}
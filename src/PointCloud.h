@@ -0,0 +1,87 @@
+#ifndef POINTCLOUD_H
+#define POINTCLOUD_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Point data used by the renderer. By default the coordinates are views on the columns of the
+// data.frame. Once reordered the point cloud owns copies of the columns sorted in the order of the
+// octree so each octant is a contiguous range of points and can be read sequentially. A point
+// cloud can also own the points of a single octant loaded from a file.
+//
+// The coordinates are either doubles (x, y, z) or, like in LAS files, int32 (xyz, interleaved)
+// with x = X*scale + offset. Point clouds read from files keep the integers of the file and the
+// columns of the data.frame are quantized when they are reordered. get_x(), get_y() and get_z()
+// return the coordinates in both cases.
+//
+// The attributes are always owned and packed: colours as RGBA8, intensity as uint16 and
+// classification as uint8. They are converted once when they are stored, 16 bits colours being
+// reduced to 8 bits, so the colours can be used as is by the renderer. For a data.frame they are
+// copies (7 B/pt) of the columns that R still holds: the memory is saved only for the point
+// clouds read from LAS or HNOF files.
+struct PointCloud
+{
+  PointCloud();
+  PointCloud(const PointCloud& other);
+  PointCloud(PointCloud&& other) = default;
+  PointCloud& operator=(PointCloud&& other) = default;
+
+  void allocate(size_t n, bool rgb, bool intensity, bool classification, const double* scale = nullptr, const double* offset = nullptr);
+  void set_rgb(const int* r, const int* g, const int* b);
+  void set_intensity(const int* intensity);
+  void set_classification(const int* classification);
+  void reorder(const uint32_t* order);
+  size_t memory() const;
+  uint64_t fingerprint() const;
+  bool has_rgb() const { return rgba != nullptr; };
+  bool has_intensity() const { return intensity != nullptr; };
+  bool has_classification() const { return classification != nullptr; };
+  bool is_quantized() const { return xyz != nullptr; };
+
+  double get_x(size_t i) const { return (xyz) ? xyz[3*i] * scale[0] + offset[0] : x[i]; };
+  double get_y(size_t i) const { return (xyz) ? xyz[3*i+1] * scale[1] + offset[1] : y[i]; };
+  double get_z(size_t i) const { return (xyz) ? xyz[3*i+2] * scale[2] + offset[2] : z[i]; };
+
+  // Scale of the integer coordinates of points within a bounding box of this extent: 0.1 mm
+  // unless the extent does not fit in an int32
+  static double quantization(double extent);
+
+  // Shift that reduces colour channels to 8 bits given the largest value of the channels: 8 if
+  // the colours are coded on 16 bits as in the LAS specification, 0 if they are already 8 bits
+  static int rgb_shift(int max) { return (max > 255) ? 8 : 0; };
+
+  size_t npoints;
+  bool reordered;
+
+  const double* x;
+  const double* y;
+  const double* z;
+  const int32_t* xyz;
+  double scale[3];
+  double offset[3];
+  const uint32_t* rgba;
+  const uint16_t* intensity;
+  const uint8_t* classification;
+
+  // Storage when the point cloud owns its data
+  std::vector<double> X;
+  std::vector<double> Y;
+  std::vector<double> Z;
+  std::vector<int32_t> XYZ;
+  std::vector<uint32_t> RGBA;
+  std::vector<uint16_t> I;
+  std::vector<uint8_t> C;
+};
+
+// Colours are packed RGBA8 in memory order R, G, B, A i.e. uploaded as 4 GL_UNSIGNED_BYTE
+inline uint32_t rgba(uint32_t r, uint32_t g, uint32_t b) { return r | (g << 8) | (b << 16) | 0xFF000000u; }
+
+// Packs a colour whose channels are reduced to 8 bits by PointCloud::rgb_shift()
+inline uint32_t rgba(uint32_t r, uint32_t g, uint32_t b, int shift)
+{
+  return rgba(std::min(r >> shift, 255u), std::min(g >> shift, 255u), std::min(b >> shift, 255u));
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef POINTLIST_H
+#define POINTLIST_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Memory of the point lists of the nodes of a registry during the build. Memory is allocated in
+// large pages and is never freed individually: all the pages are released at once when the index
+// is finalized.
+class PointArena
+{
+public:
+  PointArena() : used(PAGE_SIZE) {}
+
+  // 'bytes' must be a multiple of 8 and at most PAGE_SIZE
+  void* allocate(size_t bytes)
+  {
+    if (used + bytes > PAGE_SIZE)
+    {
+      pages.emplace_back(new uint64_t[PAGE_SIZE / sizeof(uint64_t)]);
+      used = 0;
+    }
+
+    void* ptr = reinterpret_cast<char*>(pages.back().get()) + used;
+    used += bytes;
+    return ptr;
+  }
+
+  // Takes the pages of 'other'. The memory allocated in 'other' remains valid. The last page of
+  // this arena remains the one in which the next allocations are done.
+  void merge(PointArena& other)
+  {
+    pages.insert(pages.begin(), std::make_move_iterator(other.pages.begin()), std::make_move_iterator(other.pages.end()));
+    other.clear();
+  }
+
+  void clear()
+  {
+    std::vector<std::unique_ptr<uint64_t[]>>().swap(pages);
+    used = PAGE_SIZE;
+  }
+
+  size_t memory() const { return pages.size() * PAGE_SIZE; }
+
+  static constexpr size_t PAGE_SIZE = 1 << 22;
+
+private:
+  std::vector<std::unique_ptr<uint64_t[]>> pages;
+  size_t used; // in the last page
+};
+
+// Indices of the points of a node during the build. The indices are stored in a linked list of
+// chunks allocated in a PointArena. Each chunk is as large as all the previous ones together, up
+// to MAX_CHUNK indices, so appending never copies the indices already stored and wastes at most
+// half of the memory of small lists, like a std::vector, and at most one chunk for large ones.
+class PointList
+{
+public:
+  PointList() : first(nullptr), last(nullptr), count(0) {}
+
+  void push_back(uint32_t idx, PointArena& arena)
+  {
+    if (last == nullptr || last->size == last->capacity) add_chunk(arena);
+    last->data()[last->size++] = idx;
+    count++;
+  }
+
+  // Copies the indices in insertion order in out[0] to out[size()-1]
+  void copy(uint32_t* out) const
+  {
+    for (const Chunk* chunk = first ; chunk ; chunk = chunk->next)
+    {
+      std::copy(chunk->data(), chunk->data() + chunk->size, out);
+      out += chunk->size;
+    }
+  }
+
+  size_t size() const { return count; }
+
+  // The memory belongs to the arena
+  void clear()
+  {
+    first = last = nullptr;
+    count = 0;
+  }
+
+private:
+  static constexpr uint32_t MIN_CHUNK = 8;
+  static constexpr uint32_t MAX_CHUNK = 4096;
+
+  // Header of a chunk, followed by 'capacity' indices
+  struct Chunk
+  {
+    Chunk* next;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t* data() { return reinterpret_cast<uint32_t*>(this + 1); }
+    const uint32_t* data() const { return reinterpret_cast<const uint32_t*>(this + 1); }
+  };
+
+  void add_chunk(PointArena& arena)
+  {
+    // Powers of 2 so the size of the chunks remains a multiple of 8
+    uint32_t capacity = std::min(std::max(MIN_CHUNK, count), MAX_CHUNK);
+    Chunk* chunk = static_cast<Chunk*>(arena.allocate(sizeof(Chunk) + capacity * sizeof(uint32_t)));
+    chunk->next = nullptr;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+
+    if (last) last->next = chunk; else first = chunk;
+    last = chunk;
+  }
+
+  Chunk* first;
+  Chunk* last;
+  uint32_t count;
+};
+
+#endif
@@ -10,21 +10,124 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// hnof_fingerprint
+std::string hnof_fingerprint(DataFrame df);
+RcppExport SEXP _lidRviewer_hnof_fingerprint(SEXP dfSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame >::type df(dfSEXP);
+    rcpp_result_gen = Rcpp::wrap(hnof_fingerprint(df));
+    return rcpp_result_gen;
+END_RCPP
+}
+// hnof_write
+void hnof_write(DataFrame df, std::string file, int ncpu, bool compress);
+RcppExport SEXP _lidRviewer_hnof_write(SEXP dfSEXP, SEXP fileSEXP, SEXP ncpuSEXP, SEXP compressSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< int >::type ncpu(ncpuSEXP);
+    Rcpp::traits::input_parameter< bool >::type compress(compressSEXP);
+    hnof_write(df, file, ncpu, compress);
+    return R_NilValue;
+END_RCPP
+}
+// hnof_write_las
+void hnof_write_las(std::string las, std::string file, double memory, std::string tmpdir, bool verbose);
+RcppExport SEXP _lidRviewer_hnof_write_las(SEXP lasSEXP, SEXP fileSEXP, SEXP memorySEXP, SEXP tmpdirSEXP, SEXP verboseSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type las(lasSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< double >::type memory(memorySEXP);
+    Rcpp::traits::input_parameter< std::string >::type tmpdir(tmpdirSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    hnof_write_las(las, file, memory, tmpdir, verbose);
+    return R_NilValue;
+END_RCPP
+}
+// hnof_benchmark
+List hnof_benchmark(DataFrame df, int ncpu, int times);
+RcppExport SEXP _lidRviewer_hnof_benchmark(SEXP dfSEXP, SEXP ncpuSEXP, SEXP timesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< int >::type ncpu(ncpuSEXP);
+    Rcpp::traits::input_parameter< int >::type times(timesSEXP);
+    rcpp_result_gen = Rcpp::wrap(hnof_benchmark(df, ncpu, times));
+    return rcpp_result_gen;
+END_RCPP
+}
 // viewer
-void viewer(DataFrame df, bool detach, std::string hnof);
-RcppExport SEXP _lidRviewer_viewer(SEXP dfSEXP, SEXP detachSEXP, SEXP hnofSEXP) {
+void viewer(DataFrame df, bool detach, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory);
+RcppExport SEXP _lidRviewer_viewer(SEXP dfSEXP, SEXP detachSEXP, SEXP hnofSEXP, SEXP ncpuSEXP, SEXP sortedSEXP, SEXP reorderSEXP, SEXP verboseSEXP, SEXP memorySEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< DataFrame >::type df(dfSEXP);
     Rcpp::traits::input_parameter< bool >::type detach(detachSEXP);
     Rcpp::traits::input_parameter< std::string >::type hnof(hnofSEXP);
-    viewer(df, detach, hnof);
+    Rcpp::traits::input_parameter< int >::type ncpu(ncpuSEXP);
+    Rcpp::traits::input_parameter< bool >::type sorted(sortedSEXP);
+    Rcpp::traits::input_parameter< bool >::type reorder(reorderSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    Rcpp::traits::input_parameter< double >::type memory(memorySEXP);
+    viewer(df, detach, hnof, ncpu, sorted, reorder, verbose, memory);
     return R_NilValue;
 END_RCPP
 }
 
+// registry_benchmark
+List registry_benchmark(DataFrame df, int ncpu, int times);
+RcppExport SEXP _lidRviewer_registry_benchmark(SEXP dfSEXP, SEXP ncpuSEXP, SEXP timesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< int >::type ncpu(ncpuSEXP);
+    Rcpp::traits::input_parameter< int >::type times(timesSEXP);
+    rcpp_result_gen = Rcpp::wrap(registry_benchmark(df, ncpu, times));
+    return rcpp_result_gen;
+END_RCPP
+}
+// edl_benchmark
+List edl_benchmark(int width, int height, int ncpu, int times);
+RcppExport SEXP _lidRviewer_edl_benchmark(SEXP widthSEXP, SEXP heightSEXP, SEXP ncpuSEXP, SEXP timesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type width(widthSEXP);
+    Rcpp::traits::input_parameter< int >::type height(heightSEXP);
+    Rcpp::traits::input_parameter< int >::type ncpu(ncpuSEXP);
+    Rcpp::traits::input_parameter< int >::type times(timesSEXP);
+    rcpp_result_gen = Rcpp::wrap(edl_benchmark(width, height, ncpu, times));
+    return rcpp_result_gen;
+END_RCPP
+}
+// camera_benchmark
+List camera_benchmark(int views, int times);
+RcppExport SEXP _lidRviewer_camera_benchmark(SEXP viewsSEXP, SEXP timesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type views(viewsSEXP);
+    Rcpp::traits::input_parameter< int >::type times(timesSEXP);
+    rcpp_result_gen = Rcpp::wrap(camera_benchmark(views, times));
+    return rcpp_result_gen;
+END_RCPP
+}
+
 static const R_CallMethodDef CallEntries[] = {
-    {"_lidRviewer_viewer", (DL_FUNC) &_lidRviewer_viewer, 3},
+    {"_lidRviewer_hnof_fingerprint", (DL_FUNC) &_lidRviewer_hnof_fingerprint, 1},
+    {"_lidRviewer_hnof_write", (DL_FUNC) &_lidRviewer_hnof_write, 4},
+    {"_lidRviewer_hnof_write_las", (DL_FUNC) &_lidRviewer_hnof_write_las, 5},
+    {"_lidRviewer_hnof_benchmark", (DL_FUNC) &_lidRviewer_hnof_benchmark, 3},
+    {"_lidRviewer_viewer", (DL_FUNC) &_lidRviewer_viewer, 8},
+    {"_lidRviewer_registry_benchmark", (DL_FUNC) &_lidRviewer_registry_benchmark, 3},
+    {"_lidRviewer_edl_benchmark", (DL_FUNC) &_lidRviewer_edl_benchmark, 4},
+    {"_lidRviewer_camera_benchmark", (DL_FUNC) &_lidRviewer_camera_benchmark, 2},
     {NULL, NULL, 0}
 };
 
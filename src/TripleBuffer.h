@@ -0,0 +1,39 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+// Lock-free exchange of a value between a producer thread and a consumer thread. The producer
+// writes in back() and publish()es it. The consumer update()s to get the most recently published
+// value in front(). Neither thread ever waits for the other: the three buffers are the one being
+// written, the one being read and the last published one, which is exchanged atomically.
+template<typename T>
+class TripleBuffer
+{
+public:
+  TripleBuffer() : front_index(0), back_index(2), state(1) {};
+
+  // Producer
+  T& back() { return buffers[back_index]; };
+  void publish() { back_index = state.exchange(back_index | FRESH) & INDEX; };
+
+  // Consumer. Returns false if nothing was published since the last update.
+  bool update()
+  {
+    if ((state.load() & FRESH) == 0) return false;
+    front_index = state.exchange(front_index) & INDEX;
+    return true;
+  };
+  const T& front() const { return buffers[front_index]; };
+
+private:
+  static const int INDEX = 3;
+  static const int FRESH = 4;
+
+  T buffers[3];
+  int front_index;
+  int back_index;
+  std::atomic<int> state; // index of the last published buffer | FRESH if not consumed yet
+};
+
+#endif
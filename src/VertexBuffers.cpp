@@ -0,0 +1,124 @@
+#include "VertexBuffers.h"
+
+#include <algorithm>
+#include <vector>
+
+VertexBuffers::VertexBuffers(size_t budget)
+{
+  this->budget = budget;
+  this->used = 0;
+  this->frame = 0;
+
+  gen_buffers = (PFNGLGENBUFFERSPROC)SDL_GL_GetProcAddress("glGenBuffers");
+  delete_buffers = (PFNGLDELETEBUFFERSPROC)SDL_GL_GetProcAddress("glDeleteBuffers");
+  bind_buffer = (PFNGLBINDBUFFERPROC)SDL_GL_GetProcAddress("glBindBuffer");
+  buffer_data = (PFNGLBUFFERDATAPROC)SDL_GL_GetProcAddress("glBufferData");
+
+  available = gen_buffers && delete_buffers && bind_buffer && buffer_data;
+}
+
+VertexBuffers::~VertexBuffers()
+{
+  clear();
+}
+
+// Draws a resident octant. Returns false if the octant is not resident or if its colours are
+// missing or outdated and must be uploaded.
+bool VertexBuffers::draw(uint64_t key, int slot, uint32_t generation)
+{
+  auto it = buffers.find(key);
+  if (it == buffers.end()) return false;
+
+  Entry& entry = it->second;
+  entry.last_used = frame;
+  if (entry.colors[slot] == 0 || entry.generation[slot] != generation) return false;
+
+  bind_buffer(GL_ARRAY_BUFFER, entry.vertices);
+  glVertexPointer(3, GL_FLOAT, 0, nullptr);
+  bind_buffer(GL_ARRAY_BUFFER, entry.colors[slot]);
+  glColorPointer(4, GL_UNSIGNED_BYTE, 0, nullptr);
+  bind_buffer(GL_ARRAY_BUFFER, 0);
+  glDrawArrays(GL_POINTS, 0, entry.npoints);
+
+  return true;
+}
+
+// Uploads the colours of an octant in a slot and draws it. The vertices are uploaded too if the
+// octant is not resident, otherwise xyz is ignored and can be nullptr.
+void VertexBuffers::upload(uint64_t key, int slot, uint32_t generation, const float* xyz, const uint32_t* rgba, uint32_t n)
+{
+  auto it = buffers.find(key);
+
+  if (it == buffers.end())
+  {
+    Entry entry;
+    gen_buffers(1, &entry.vertices);
+    std::fill(entry.colors, entry.colors + SLOTS, 0);
+    std::fill(entry.generation, entry.generation + SLOTS, 0);
+    entry.npoints = n;
+
+    bind_buffer(GL_ARRAY_BUFFER, entry.vertices);
+    buffer_data(GL_ARRAY_BUFFER, (size_t)n * 3 * sizeof(float), xyz, GL_STATIC_DRAW);
+    used += (size_t)n * 3 * sizeof(float);
+
+    it = buffers.emplace(key, entry).first;
+  }
+
+  Entry& entry = it->second;
+  entry.last_used = frame;
+
+  if (entry.colors[slot] == 0)
+  {
+    gen_buffers(1, &entry.colors[slot]);
+    used += (size_t)entry.npoints * sizeof(uint32_t);
+  }
+
+  entry.generation[slot] = generation;
+  bind_buffer(GL_ARRAY_BUFFER, entry.colors[slot]);
+  buffer_data(GL_ARRAY_BUFFER, (size_t)entry.npoints * sizeof(uint32_t), rgba, GL_STATIC_DRAW);
+  bind_buffer(GL_ARRAY_BUFFER, 0);
+
+  draw(key, slot, generation);
+}
+
+void VertexBuffers::release(Entry& entry)
+{
+  delete_buffers(1, &entry.vertices);
+  used -= (size_t)entry.npoints * 3 * sizeof(float);
+
+  for (int slot = 0 ; slot < SLOTS ; slot++)
+  {
+    if (entry.colors[slot] == 0) continue;
+    delete_buffers(1, &entry.colors[slot]);
+    used -= (size_t)entry.npoints * sizeof(uint32_t);
+  }
+}
+
+void VertexBuffers::evict()
+{
+  if (used <= budget) return;
+
+  std::vector<std::pair<uint64_t, uint64_t>> candidates; // (last_used, key)
+  for (const auto& pair : buffers)
+  {
+    if (pair.second.last_used < frame)
+      candidates.emplace_back(pair.second.last_used, pair.first);
+  }
+
+  std::sort(candidates.begin(), candidates.end());
+
+  for (const auto& candidate : candidates)
+  {
+    if (used <= budget) break;
+    auto it = buffers.find(candidate.second);
+    release(it->second);
+    buffers.erase(it);
+  }
+}
+
+void VertexBuffers::clear()
+{
+  if (!available) return;
+  for (auto& pair : buffers) release(pair.second);
+  buffers.clear();
+}
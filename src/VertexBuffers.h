@@ -0,0 +1,66 @@
+#ifndef VERTEXBUFFERS_H
+#define VERTEXBUFFERS_H
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+// GPU buffers of the vertices and of the colours of the octants. An octant is uploaded once and
+// drawn with a single call as long as it is resident. An octant has one RGBA8 colour buffer per
+// colouring (slot) so switching from a colouring to another does not recompute the colours. A
+// colour buffer is uploaded again only when its generation changes. The buffers are kept within a
+// memory budget, the least recently used being released first but never the ones drawn in the
+// current frame.
+//
+// Requires OpenGL 1.5. The entry points are loaded at run time because they are not exported by
+// every OpenGL library (e.g. Windows). If they are not available is_available() is false and the
+// caller must draw the points itself. Must be used from the thread owning the OpenGL context.
+class VertexBuffers
+{
+public:
+  static const int SLOTS = 4;
+
+  VertexBuffers(size_t budget);
+  ~VertexBuffers();
+
+  bool is_available() const { return available; };
+  bool draw(uint64_t key, int slot, uint32_t generation);
+  void upload(uint64_t key, int slot, uint32_t generation, const float* xyz, const uint32_t* rgba, uint32_t n);
+  bool contains(uint64_t key) const { return buffers.count(key) > 0; };
+  void next_frame() { frame++; };
+  void evict();
+  void clear();
+  size_t memory() const { return used; };
+  size_t get_budget() const { return budget; };
+
+  // GPU memory of a point drawn with one colouring
+  static const size_t BYTES_PER_POINT = 3 * sizeof(float) + sizeof(uint32_t);
+
+private:
+  struct Entry
+  {
+    GLuint vertices;
+    GLuint colors[SLOTS];
+    uint32_t generation[SLOTS];
+    uint32_t npoints;
+    uint64_t last_used;
+  };
+
+  void release(Entry& entry);
+
+  bool available;
+  size_t budget;
+  size_t used;
+  uint64_t frame;
+  std::unordered_map<uint64_t, Entry> buffers;
+
+  PFNGLGENBUFFERSPROC gen_buffers;
+  PFNGLDELETEBUFFERSPROC delete_buffers;
+  PFNGLBINDBUFFERPROC bind_buffer;
+  PFNGLBUFFERDATAPROC buffer_data;
+};
+
+#endif
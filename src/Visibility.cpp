@@ -0,0 +1,238 @@
+#include "Visibility.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool operator==(const View& a, const View& b)
+{
+  const Camera& u = a.camera;
+  const Camera& v = b.camera;
+  return u.angleY == v.angleY && u.angleZ == v.angleZ && u.distance == v.distance &&
+         u.deltaX == v.deltaX && u.deltaY == v.deltaY && u.deltaZ == v.deltaZ &&
+         a.screen_height == b.screen_height && a.fov == b.fov && a.budget == b.budget;
+}
+
+// An octant waiting to be visited by the traversal. Its position is relative to the center of the
+// scene. 'planes' are the planes of the frustum the octant is not entirely in front of. 'id' is
+// its index in the frozen hierarchy if any, otherwise 'octant' is its node in the registry.
+struct Candidate
+{
+  float screen_size;
+  float x;
+  float y;
+  float z;
+  float halfsize;
+  uint64_t count;
+  Key key;
+  uint32_t id;
+  const Node* octant;
+  unsigned char planes;
+};
+
+static bool operator<(const Candidate& a, const Candidate& b) { return a.screen_size < b.screen_size; }
+
+static Candidate make_candidate(const Octree& index, const View& view, float slope, const Key& key, uint64_t count, uint32_t id, const Node* octant, unsigned char planes)
+{
+  double bbox[4];
+  index.set_bbox(key, bbox);
+
+  Candidate c;
+  c.x = bbox[0] - view.xcenter;
+  c.y = bbox[1] - view.ycenter;
+  c.z = bbox[2] - view.zcenter;
+  c.halfsize = bbox[3];
+  c.count = count;
+  c.key = key;
+  c.id = id;
+  c.octant = octant;
+  c.planes = planes;
+
+  const Camera& camera = view.camera;
+  float radius = c.halfsize * 2 * 1.414f;
+  float distance = std::sqrt((camera.x - c.x) * (camera.x - c.x) + (camera.y - c.y) * (camera.y - c.y) + (camera.z - c.z) * (camera.z - c.z));
+  c.screen_size = (view.screen_height / 2.0f) * (radius / (slope * distance));
+  return c;
+}
+
+// Best-first traversal: the octants are visited by decreasing screen size using a max-heap of the
+// children of the octants already visited. The traversal stops as soon as the octants collected
+// hold more than the point budget so its cost depends on the budget and not on the number of
+// octants in view. Once the index is finalized the children are found in the frozen hierarchy.
+// Before that the tree changes and the children are looked up in the registry.
+void query_visible_octants(const Octree& index, const View& view, VisibleOctants& visible)
+{
+  visible.octants.clear();
+  visible.truncated = false;
+  visible.budget = view.budget;
+
+  bool frozen = index.is_frozen();
+  const std::vector<FrozenNode>& hierarchy = index.get_hierarchy();
+  const CFrustum& frustum = view.camera.getFrustum();
+  float slope = std::tan(view.fov*M_PI/180/2.0f);
+
+  Candidate root;
+  if (frozen)
+  {
+    if (hierarchy.front().key != Key::root()) return;
+    root = make_candidate(index, view, slope, Key::root(), hierarchy.front().count, 0, nullptr, CFrustum::ALL_PLANES);
+  }
+  else
+  {
+    auto it = index.registry.find(Key::root());
+    if (it == index.registry.end()) return;
+    root = make_candidate(index, view, slope, Key::root(), it->second.npoints(), 0, &it->second, CFrustum::ALL_PLANES);
+  }
+
+  if (!frustum.CubeInFrustum(root.x, root.y, root.z, root.halfsize, root.planes)) return;
+
+  std::vector<Candidate> heap;
+  heap.push_back(root);
+
+  uint64_t n = 0;
+  while (!heap.empty())
+  {
+    std::pop_heap(heap.begin(), heap.end());
+    Candidate candidate = heap.back();
+    heap.pop_back();
+
+    if (candidate.screen_size <= 200) continue;
+
+    if (frozen)
+    {
+      const FrozenNode& node = hierarchy[candidate.id];
+      visible.octants.push_back({node.key, node.offset, node.count, nullptr});
+    }
+    else
+    {
+      visible.octants.push_back({candidate.key, 0, candidate.count, candidate.octant});
+    }
+
+    n += candidate.count;
+    if (n > view.budget)
+    {
+      visible.truncated = true;
+      return;
+    }
+
+    // Push the children in the frustum. If the octant is entirely inside the frustum there is
+    // nothing to test.
+    unsigned char children_planes[8];
+    unsigned char children = 0xFF;
+    if (candidate.planes != 0)
+      children = frustum.ChildrenInFrustum(candidate.x, candidate.y, candidate.z, candidate.halfsize / 2, candidate.planes, children_planes);
+    else
+      std::fill(children_planes, children_planes + 8, 0);
+
+    if (frozen)
+    {
+      const FrozenNode& node = hierarchy[candidate.id];
+      uint32_t next = node.first_child;
+
+      for (int k = 0 ; k < 8 ; k++)
+      {
+        if ((node.children & (1 << k)) == 0) continue;
+        uint32_t id = next++;
+        if ((children & (1 << k)) == 0) continue;
+
+        const FrozenNode& child = hierarchy[id];
+        Candidate c = make_candidate(index, view, slope, child.key, child.count, id, nullptr, children_planes[k]);
+        if (c.screen_size <= 200) continue;
+
+        heap.push_back(c);
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+    else
+    {
+      std::array<Key, 8> children_keys = candidate.key.get_children();
+      for (int k = 0 ; k < 8 ; k++)
+      {
+        if ((children & (1 << k)) == 0) continue;
+
+        auto it = index.registry.find(children_keys[k]);
+        if (it == index.registry.end()) continue;
+
+        Candidate c = make_candidate(index, view, slope, children_keys[k], it->second.npoints(), 0, &it->second, children_planes[k]);
+        if (c.screen_size <= 200) continue;
+
+        heap.push_back(c);
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+  }
+}
+
+VisibilityQuery::VisibilityQuery(const Octree& index) : index(index)
+{
+  published = false;
+  requested = false;
+  busy = false;
+  stop = false;
+  worker = std::thread(&VisibilityQuery::work, this);
+}
+
+VisibilityQuery::~VisibilityQuery()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+// Replaces the pending request, if any. The worker always computes the latest view.
+void VisibilityQuery::request(const View& view)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->view = view;
+    requested = true;
+  }
+  cv.notify_one();
+}
+
+// Makes the most recent result available with get(). Returns true if it is a new one. If 'wait'
+// and nothing was ever computed, waits for the first result.
+bool VisibilityQuery::update(bool wait)
+{
+  if (wait && !published)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return published || !(requested || busy); });
+  }
+
+  return results.update();
+}
+
+bool VisibilityQuery::is_busy()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return requested || busy;
+}
+
+void VisibilityQuery::work()
+{
+  while (true)
+  {
+    View view;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return stop || requested; });
+      if (stop) return;
+      view = this->view;
+      requested = false;
+      busy = true;
+    }
+
+    query_visible_octants(index, view, results.back());
+    results.publish();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      published = true;
+      busy = false;
+    }
+    done.notify_all();
+  }
+}
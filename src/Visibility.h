@@ -0,0 +1,89 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Octree.h"
+#include "TripleBuffer.h"
+#include "camera.h"
+
+// Snapshot of everything a visibility query depends on. The camera must have been positioned
+// with Camera::update() so its frustum and its position are up to date.
+struct View
+{
+  Camera camera;
+  int screen_height;
+  float fov;
+  double xcenter;
+  double ycenter;
+  double zcenter;
+  uint32_t budget; // maximum number of points
+};
+
+// An octant in view. Once the index is finalized its points are the range 'offset', 'count' of
+// the octree order. Before that 'node' is its node in the registry, still being filled.
+struct VisibleOctant
+{
+  Key key;
+  uint64_t offset;
+  uint64_t count;
+  const Node* node;
+};
+
+// Result of a query. 'truncated' if the point budget stopped the query before all the octants
+// large enough on screen were collected. 'budget' is the point budget of the view queried.
+struct VisibleOctants
+{
+  std::vector<VisibleOctant> octants;
+  bool truncated = false;
+  uint32_t budget = 0;
+};
+
+// Two views are the same if the camera did not move, the window was not resized and the budget
+// did not change
+bool operator==(const View& a, const View& b);
+inline bool operator!=(const View& a, const View& b) { return !(a == b); }
+
+// Octants of the index that are in the view and large enough on screen, by decreasing screen
+// size, until they hold more than the point budget
+void query_visible_octants(const Octree& index, const View& view, VisibleOctants& visible);
+
+// Visibility queries computed on a worker thread. The render thread request()s the query of the
+// latest view and, at each frame, update()s to the most recent result without ever waiting for
+// the worker. The results are exchanged through a lock-free triple buffer. The octants of the
+// index must not be modified (i.e. the index is built) while the object exists.
+class VisibilityQuery
+{
+public:
+  VisibilityQuery(const Octree& index);
+  ~VisibilityQuery();
+
+  void request(const View& view);
+  bool update(bool wait = false);
+  const VisibleOctants& get() const { return results.front(); };
+  bool is_busy();
+
+private:
+  void work();
+
+  const Octree& index;
+  TripleBuffer<VisibleOctants> results;
+  std::atomic<bool> published;
+
+  View view;
+  bool requested;
+  bool busy;
+  bool stop;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable done;
+  std::thread worker;
+};
+
+#endif
@@ -2,11 +2,9 @@
 
 #include <cmath>
 
-#include <GL/glu.h>
-
-static bool InvertMatrix(const GLfloat m[16], GLfloat invOut[16])
+static bool InvertMatrix(const float m[16], float invOut[16])
 {
-  GLfloat inv[16], det;
+  float inv[16], det;
   int i;
 
   inv[0] = m[5]  * m[10] * m[15] -
@@ -134,6 +132,79 @@ static bool InvertMatrix(const GLfloat m[16], GLfloat invOut[16])
   return true;
 }
 
+// The matrices below are column-major and are the ones computed by the OpenGL fixed pipeline
+// functions of the same name.
+
+static void identity(double m[16])
+{
+  for (int i = 0 ; i < 16 ; i++) m[i] = (i % 5 == 0) ? 1 : 0;
+}
+
+// m = m * b
+static void multiply(double m[16], const double b[16])
+{
+  double r[16];
+  for (int col = 0 ; col < 4 ; col++)
+  {
+    for (int row = 0 ; row < 4 ; row++)
+    {
+      r[col*4+row] = 0;
+      for (int k = 0 ; k < 4 ; k++) r[col*4+row] += m[k*4+row] * b[col*4+k];
+    }
+  }
+  for (int i = 0 ; i < 16 ; i++) m[i] = r[i];
+}
+
+static void translated(double m[16], double x, double y, double z)
+{
+  double t[16];
+  identity(t);
+  t[12] = x;
+  t[13] = y;
+  t[14] = z;
+  multiply(m, t);
+}
+
+static void rotated(double m[16], double angle, double x, double y, double z)
+{
+  double norm = std::sqrt(x*x + y*y + z*z);
+  x /= norm;
+  y /= norm;
+  z /= norm;
+
+  double a = angle * M_PI / 180;
+  double c = std::cos(a);
+  double s = std::sin(a);
+
+  double r[16];
+  identity(r);
+  r[0] = x*x*(1-c) + c;   r[4] = x*y*(1-c) - z*s; r[8]  = x*z*(1-c) + y*s;
+  r[1] = y*x*(1-c) + z*s; r[5] = y*y*(1-c) + c;   r[9]  = y*z*(1-c) - x*s;
+  r[2] = x*z*(1-c) - y*s; r[6] = y*z*(1-c) + x*s; r[10] = z*z*(1-c) + c;
+  multiply(m, r);
+}
+
+static void look_at(double m[16], double ex, double ey, double ez, double cx, double cy, double cz, double ux, double uy, double uz)
+{
+  double f[3] = {cx - ex, cy - ey, cz - ez};
+  double n = std::sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+  f[0] /= n; f[1] /= n; f[2] /= n;
+
+  // s = f x up, u = s x f
+  double s[3] = {f[1]*uz - f[2]*uy, f[2]*ux - f[0]*uz, f[0]*uy - f[1]*ux};
+  n = std::sqrt(s[0]*s[0] + s[1]*s[1] + s[2]*s[2]);
+  s[0] /= n; s[1] /= n; s[2] /= n;
+  double u[3] = {s[1]*f[2] - s[2]*f[1], s[2]*f[0] - s[0]*f[2], s[0]*f[1] - s[1]*f[0]};
+
+  double r[16];
+  identity(r);
+  r[0] = s[0];  r[4] = s[1];  r[8]  = s[2];
+  r[1] = u[0];  r[5] = u[1];  r[9]  = u[2];
+  r[2] = -f[0]; r[6] = -f[1]; r[10] = -f[2];
+  multiply(m, r);
+  translated(m, -ex, -ey, -ez);
+}
+
 Camera::Camera()
 {
   angleY = 20;
@@ -146,6 +217,9 @@ Camera::Camera()
   panSensivity = 10;
   rotateSensivity = 0.3;
   zoomSensivity = 30;
+  x = y = z = 0;
+  identity(modelview);
+  setPerspective(70, 1, 1, 100000);
 }
 
 void Camera::rotate(int xrel, int yrel)
@@ -215,40 +289,89 @@ void Camera::setDistance(double dist)
     distance = dist;
 }
 
-void Camera::look()
+// Same as gluPerspective()
+void Camera::setPerspective(double fov, double aspect, double zNear, double zFar)
 {
-  glTranslated(deltaX, deltaY, 0.0);
-  gluLookAt(distance,0,0,0,0,0,0,0,1);
-  glRotated(angleY,0,1,0);
-  glRotated(angleZ,0,0,1);
-  glRotated(90, 0, 0, 1);
-
-  frustum.CalculateFrustum();
-
-  // Get the camera position
-  GLfloat viewMatrix[16];
-  glGetFloatv(GL_MODELVIEW_MATRIX, viewMatrix);
+  double f = 1 / std::tan(fov * M_PI / 360);
+  for (int i = 0 ; i < 16 ; i++) projection[i] = 0;
+  projection[0] = f / aspect;
+  projection[5] = f;
+  projection[10] = (zFar + zNear) / (zNear - zFar);
+  projection[11] = -1;
+  projection[14] = 2 * zFar * zNear / (zNear - zFar);
+}
 
-  /*glm::mat4 ConversionMatrix = glm::make_mat4(viewMatrix);
-   glm::vec4 cameraPos4 = glm::inverse(ConversionMatrix) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-   glm::vec3 CameraPos = glm::vec3(cameraPos4);*/
+// Computes the modelview matrix, the frustum and the position of the camera from the parameters
+// of the camera without OpenGL
+void Camera::update()
+{
+  identity(modelview);
+  translated(modelview, deltaX, deltaY, 0.0);
+  look_at(modelview, distance,0,0,0,0,0,0,0,1);
+  rotated(modelview, angleY,0,1,0);
+  rotated(modelview, angleZ,0,0,1);
+  rotated(modelview, 90, 0, 0, 1);
+
+  float proj[16];
+  float modl[16];
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    proj[i] = projection[i];
+    modl[i] = modelview[i];
+  }
 
-  /*GLfloat CameraPos[4];
-   CameraPos[0] = invMatrix[0] * 0.0f + invMatrix[4] * 0.0f + invMatrix[8]  * 0.0f + invMatrix[12] * 1.0f;
-   CameraPos[1] = invMatrix[1] * 0.0f + invMatrix[5] * 0.0f + invMatrix[9]  * 0.0f + invMatrix[13] * 1.0f;
-   CameraPos[2] = invMatrix[2] * 0.0f + invMatrix[6] * 0.0f + invMatrix[10] * 0.0f + invMatrix[14] * 1.0f;
-   CameraPos[3] = invMatrix[3] * 0.0f + invMatrix[7] * 0.0f + invMatrix[11] * 0.0f + invMatrix[15] * 1.0f;*/
+  frustum.CalculateFrustum(proj, modl);
 
-  GLfloat invMatrix[16];
-  InvertMatrix(viewMatrix, invMatrix);
+  // Get the camera position
+  float invMatrix[16];
+  InvertMatrix(modl, invMatrix);
 
   x = invMatrix[12];
   y = invMatrix[13];
   z = invMatrix[14];
 }
 
-bool Camera::see(float px, float py, float pz, float hsize)
+bool Camera::see(float px, float py, float pz, float hsize) const
 {
   return frustum.CubeInFrustum(px, py, pz, hsize);
 }
 
+// Rotation of v by 'angle' degrees around the axis (x, y, z) with the Rodrigues formula
+static void rotate_reference(double v[3], double angle, double x, double y, double z)
+{
+  double norm = std::sqrt(x*x + y*y + z*z);
+  double k[3] = {x / norm, y / norm, z / norm};
+  double a = angle * M_PI / 180;
+  double c = std::cos(a);
+  double s = std::sin(a);
+
+  double dot = k[0]*v[0] + k[1]*v[1] + k[2]*v[2];
+  double cross[3] = {k[1]*v[2] - k[2]*v[1], k[2]*v[0] - k[0]*v[2], k[0]*v[1] - k[1]*v[0]};
+  for (int i = 0 ; i < 3 ; i++) v[i] = v[i]*c + cross[i]*s + k[i]*dot*(1-c);
+}
+
+// The last transformation of update() applies first to the points
+void Camera::modelview_reference(const Camera& camera, const double p[3], double q[3])
+{
+  double v[3] = {p[0], p[1], p[2]};
+  rotate_reference(v, 90, 0, 0, 1);
+  rotate_reference(v, camera.angleZ, 0, 0, 1);
+  rotate_reference(v, camera.angleY, 0, 1, 0);
+
+  // Looking at the origin from (distance, 0, 0) with z up: the camera looks towards -x, its right
+  // is +y and its up is +z
+  q[0] = v[1] + camera.deltaX;
+  q[1] = v[2] + camera.deltaY;
+  q[2] = v[0] - camera.distance;
+}
+
+// Perspective division of the point q of the camera space. The depth is linear in 1/z and ranges
+// from -1 on the near plane to 1 on the far plane.
+void Camera::projection_reference(double fov, double aspect, double zNear, double zFar, const double q[3], double ndc[3])
+{
+  double t = std::tan(fov * M_PI / 360);
+  double d = -q[2];
+  ndc[0] = q[0] / (d * t * aspect);
+  ndc[1] = q[1] / (d * t);
+  ndc[2] = 2 * (1/zNear - 1/d) / (1/zNear - 1/zFar) - 1;
+}
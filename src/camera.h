@@ -3,6 +3,8 @@
 
 #include "Frustum.h"
 
+// Orbit camera. The view and projection matrices and the frustum are computed in plain C++ so
+// they can be used on any thread (see Visibility.h). The renderer loads the matrices in OpenGL.
 class Camera
 {
   public:
@@ -11,14 +13,24 @@ class Camera
     void rotate(int xrel, int yrel);
     void pan(int xrel, int yrel);
     void zoom(int zrel);
-    void look();
+    void update();
+    void setPerspective(double fov, double aspect, double zNear, double zFar);
+    const double* getProjection() const { return projection; };
+    const double* getModelview() const { return modelview; };
+    const CFrustum& getFrustum() const { return frustum; };
     void setRotateSensivity(double sensivity);
     void setPanSensivity(double sensivity);
     void setZoomSensivity(double sensivity);
     void setDeltaXYZ(double dx, double dy, double dz);
     void setDistance(double);
 
-    bool see(float x, float y, float z, float hsize);
+    bool see(float x, float y, float z, float hsize) const;
+
+    // Straightforward implementations of the fixed pipeline transformations (glTranslated,
+    // gluLookAt and glRotated, then gluPerspective) applied to a single point without matrices.
+    // References for the validation of update() and setPerspective().
+    static void modelview_reference(const Camera& camera, const double p[3], double q[3]);
+    static void projection_reference(double fov, double aspect, double zNear, double zFar, const double q[3], double ndc[3]);
 
     bool changed;
     double zoomSensivity;
@@ -36,6 +48,10 @@ class Camera
 
 private:
     CFrustum frustum;
+
+    // Column-major as in OpenGL
+    double projection[16];
+    double modelview[16];
 };
 
 #endif //CAMERA_H
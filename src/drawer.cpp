@@ -1,12 +1,18 @@
 #include "drawer.h"
 #include "PSquare.h"
+#include "LasReader.h"
+#include "Messages.h"
 
+#include <cctype>
 #include <chrono>
-#include <random>
+#include <fstream>
 
 #include <GL/gl.h>
 #include <GL/glu.h>
 
+// Time without interaction (ms) after which the camera is considered idle
+const int IDLE_DELAY = 200;
+
 const std::vector<std::array<unsigned char, 3>> zgradient = {
   {0, 0, 255},
   {0, 29, 252},
@@ -85,7 +91,7 @@ const std::vector<std::array<unsigned char, 3>> igradient = {
   {255, 255, 234}   // [25]
 };
 
-Drawer::Drawer(SDL_Window *window, DataFrame df, std::string hnof)
+Drawer::Drawer(SDL_Window *window, DataFrame df, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory)
 {
   zNear = 1;
   zFar = 100000;
@@ -95,30 +101,115 @@ Drawer::Drawer(SDL_Window *window, DataFrame df, std::string hnof)
 
   init_viewport();
 
-  this->df = df;
-  this->x = df["X"];
-  this->y = df["Y"];
-  this->z = df["Z"];
+  auto file_ext = [](const std::string& str, const std::string& suffix) -> bool {
+    if (str.length() >= suffix.length()) {
+      return std::equal(suffix.begin(), suffix.end(), str.end() - suffix.length(), [](char a, char b) { return a == std::tolower(b); });
+    } else {
+      return false;
+    }
+  };
+
+  bool use_hnof = !hnof.empty();
+  bool is_las = file_ext(hnof, ".las") || file_ext(hnof, ".laz");
+  bool out_of_core = use_hnof && !is_las && df.size() == 0;
 
-  this->npoints = x.length();
+  this->fingerprint = 0;
 
-  PSquare zp99(0.99);
-  this->minx = this->maxx = x[0];
-  this->miny = this->maxy = y[0];
-  this->minz = this->maxz = z[0];
-  for (int i = 1; i < this->npoints; ++i)
+  if (out_of_core)
+  {
+    // The points are not in memory. The octants are read from the file when they are displayed.
+    if (!index.read(hnof))
+      throw std::runtime_error("Failed to read the file: " + hnof);
+    if (!index.has_data())
+      throw std::runtime_error("The file does not contain the points and cannot be displayed without the point cloud: " + hnof);
+
+    // The points are stored in the octree order. The order is useless.
+    index.release_order();
+
+    const HnofData& data = index.get_data();
+    this->store.reset(new NodeStore(hnof, data, index.get_npoints(), memory, ncpu));
+    this->npoints = index.get_npoints();
+
+    this->minx = data.bbox[0];
+    this->miny = data.bbox[1];
+    this->minz = data.bbox[2];
+    this->maxx = data.bbox[3];
+    this->maxy = data.bbox[4];
+    this->maxz = data.bbox[5];
+
+    // The root octant is a uniform subsample of the point cloud. It is used to estimate the
+    // range of the attributes.
+    const std::vector<FrozenNode>& hierarchy = index.get_hierarchy();
+    if (!hierarchy.empty() && hierarchy.front().key == Key::root())
+      points = store->load(hierarchy.front().offset, hierarchy.front().count);
+  }
+  else if (is_las && df.size() == 0)
+  {
+    // The LAS file is read natively without loading it in R
+    LasReader las(hnof);
+    points = las.read(ncpu);
+    this->npoints = points.npoints;
+  }
+  else
   {
-    if (x[i] < this->minx) this->minx = x[i];
-    if (x[i] > this->maxx) this->maxx = x[i];
+    this->x = df["X"];
+    this->y = df["Y"];
+    this->z = df["Z"];
 
-    if (y[i] < this->miny) this->miny = y[i];
-    if (y[i] > this->maxy) this->maxy = y[i];
+    this->npoints = x.length();
 
-    if (z[i] < this->minz) this->minz = z[i];
-    if (z[i] > this->maxz) this->maxz = z[i];
+    points.npoints = npoints;
+    points.x = &x[0];
+    points.y = &y[0];
+    points.z = &z[0];
 
-    zp99.addDataPoint(z[i]);
+    if (df.containsElementNamed("R") && df.containsElementNamed("G") && df.containsElementNamed("B"))
+    {
+      IntegerVector r = df["R"];
+      IntegerVector g = df["G"];
+      IntegerVector b = df["B"];
+      points.set_rgb(&r[0], &g[0], &b[0]);
+    }
+
+    if (df.containsElementNamed("Intensity"))
+    {
+      IntegerVector intensity = df["Intensity"];
+      points.set_intensity(&intensity[0]);
+    }
+
+    if (df.containsElementNamed("Classification"))
+    {
+      IntegerVector classification = df["Classification"];
+      points.set_classification(&classification[0]);
+    }
+  }
+
+  if (!out_of_core)
+  {
+    this->minx = this->maxx = points.get_x(0);
+    this->miny = this->maxy = points.get_y(0);
+    this->minz = this->maxz = points.get_z(0);
+    for (uint32_t i = 1; i < this->npoints; ++i)
+    {
+      double x = points.get_x(i);
+      double y = points.get_y(i);
+      double z = points.get_z(i);
+
+      if (x < this->minx) this->minx = x;
+      if (x > this->maxx) this->maxx = x;
+
+      if (y < this->miny) this->miny = y;
+      if (y > this->maxy) this->maxy = y;
+
+      if (z < this->minz) this->minz = z;
+      if (z > this->maxz) this->maxz = z;
+    }
   }
+
+  // The quantile is estimated on a subsample. It is much faster and accurate enough for colouring.
+  PSquare zp99(0.99);
+  size_t qstride = std::max<size_t>(1, points.npoints / 1000000);
+  for (size_t i = 0 ; i < points.npoints ; i += qstride) zp99.addDataPoint(points.get_z(i));
   this->xcenter = (maxx+minx)/2;
   this->ycenter = (maxy+miny)/2;
   this->zcenter = (maxz+minz)/2;
@@ -127,71 +218,229 @@ Drawer::Drawer(SDL_Window *window, DataFrame df, std::string hnof)
   this->zrange = maxz-minz;
   this->range = std::max(xrange, yrange);
   this->zqmin = minz;
-  this->zqmax = zp99.getQuantile();
+  this->zqmax = (points.npoints > 0) ? zp99.getQuantile() : maxz;
 
   this->draw_index = false;
-  this->point_budget = 300000;
+  this->point_budget = budget.get();
+  this->last_interaction = std::chrono::high_resolution_clock::now();
+  this->refined = false;
+  this->truncated = false;
+  this->rendered_points = 0;
+  this->last_view.screen_height = -1;
   this->point_size = 5.0;
   this->lightning = true;
 
-  this->pp.reserve(this->point_budget*1.1);
 
   double distance = sqrt(xrange*xrange+yrange*yrange);
   this->camera.setDistance(distance);
   this->camera.setPanSensivity(distance*0.001);
   this->camera.setZoomSensivity(distance*0.05);
 
+  this->zlut = pack_palette(zgradient);
+  this->ilut = pack_palette(igradient);
+  this->classlut = pack_palette(classcolor);
+  for (int i = 0 ; i < NATTRIBUTES ; i++)
+  {
+    scales[i] = {0, 0, 0, nullptr, 0};
+    color_generation[i] = 0;
+  }
+
   setAttribute(Attribute::Z);
   setAttribute(Attribute::RGB);
 
-  auto start = std::chrono::high_resolution_clock::now();
+  // Quick strided sample of the point cloud displayed until the spatial index is usable
+  if (!out_of_core)
+  {
+    size_t stride = std::max<size_t>(1, npoints / point_budget);
+    for (size_t i = 0 ; i < npoints ; i += stride) sample.push_back(i);
+  }
 
-  auto file_ext = [](const std::string& str, const std::string& suffix) -> bool {
-    if (str.length() >= suffix.length()) {
-      return (0 == str.compare(str.length() - suffix.length(), suffix.length(), suffix));
-    } else {
-      return false;
+  this->indexing = false;
+  this->indexed = false;
+  this->index_updated = false;
+  this->render_waiting = false;
+  this->cancel = false;
+
+  // The octants are kept in GPU memory when possible
+  this->vbo.reset(new VertexBuffers(512*1024*1024));
+  if (verbose && !vbo->is_available()) post_message("Vertex buffers not supported. Points are drawn from client memory\n");
+
+  this->shading.reset(new Edl(ncpu));
+
+  if (out_of_core)
+  {
+    if (verbose) post_message("Out-of-core rendering of %llu points with a memory budget of %.1lf MB\n", (unsigned long long)npoints, memory/1e6);
+  }
+  else
+  {
+    // A spatial index read from a file is used only if it was built for this point cloud. Otherwise
+    // the index is built in the background, the rendering displays what is already indexed, and the
+    // index is written in the file.
+    this->fingerprint = points.fingerprint();
+    if (is_las) hnof = hnof.substr(0, hnof.size() - 3) + "hno";
+
+    if (!(use_hnof && read_index(hnof, reorder, verbose)))
+    {
+      this->indexing = true;
+      this->builder = std::thread(&Drawer::build_index_task, this, hnof, ncpu, sorted, reorder, verbose);
     }
+  }
+
+  camera.changed = true;
+  draw();
+}
+
+Drawer::~Drawer()
+{
+  cancel = true;
+  if (builder.joinable()) builder.join();
+}
+
+// Reads the spatial index of the point cloud from a file. Returns false if the file does not exist,
+// cannot be read or contains the index of another point cloud.
+bool Drawer::read_index(const std::string& hnof, bool reorder, bool verbose)
+{
+  std::ifstream test(hnof, std::ios::binary);
+  if (!test) return false;
+  test.close();
+
+  Octree tree;
+
+  try
+  {
+    tree.read(hnof);
+  }
+  catch (std::exception& e)
+  {
+    if (verbose) post_message("Spatial index not read: %s\n", e.what());
+    return false;
+  }
+
+  if (tree.get_npoints() != npoints || tree.get_fingerprint() != fingerprint)
+  {
+    if (verbose) post_message("Spatial index %s does not match the point cloud and is rebuilt\n", hnof.c_str());
+    return false;
+  }
+
+  index = std::move(tree);
+
+  if (reorder)
+  {
+    points.reorder(index.get_order());
+    index.release_order();
+  }
+
+  if (verbose) post_message("Spatial index read from %s\n", hnof.c_str());
+
+  return true;
+}
+
+// Runs on a worker thread. A failure of the indexation (e.g. too many points or not enough
+// memory) must not terminate the process: the index is left empty, the rendering thread keeps
+// displaying the strided sample and reports the error.
+void Drawer::build_index_task(std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose)
+{
+  try
+  {
+    build_index(hnof, ncpu, sorted, reorder, verbose);
+  }
+  catch (std::exception& e)
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    index = Octree();
+    index_error = e.what();
+  }
+
+  indexing = false;
+  index_updated = true;
+}
+
+// Every modification of the index or of the points visible by the rendering thread is done while
+// holding index_mutex.
+void Drawer::build_index(const std::string& hnof, int ncpu, bool sorted, bool reorder, bool verbose)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Gives the rendering thread a chance to take the lock between two batches
+  auto yield = [this]()
+  {
+    while (render_waiting && !cancel) std::this_thread::yield();
   };
 
-  bool use_hnof = !hnof.empty();
-  bool is_las = file_ext(hnof, ".las") || file_ext(hnof, ".laz");
+  Octree tree(points);
+  tree.set_fingerprint(fingerprint);
+
+  if (sorted)
+  {
+    tree.build_sorted(&cancel);
+  }
+  else if (ncpu > 1)
+  {
+    tree.build(ncpu, &cancel);
+  }
 
-  if (!use_hnof || (use_hnof && is_las))
   {
-    this->index = Octree(&x[0], &y[0], &z[0], x.size());
+    std::lock_guard<std::mutex> lock(index_mutex);
+    index = std::move(tree);
+  }
 
-    for (size_t i = 0 ; i < x.size() ; i++)
+  // Sequential insertion in the shared index so the octants are displayed as soon as they are built
+  if (!sorted && ncpu <= 1)
+  {
+    const size_t batch = 50000;
+    for (size_t i = 0 ; i < npoints && !cancel ; i += batch)
     {
-      index.insert(i);
-      if (i % 1000000 == 0)
       {
-        camera.changed = true;
-        draw();
+        std::lock_guard<std::mutex> lock(index_mutex);
+        size_t end = std::min<size_t>(i + batch, npoints);
+        for (size_t j = i ; j < end ; j++) index.insert(j);
       }
+
+      if ((i / batch) % 20 == 0) index_updated = true;
+      yield();
     }
+  }
+
+  if (cancel) return;
+
+  size_t memory_build;
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    memory_build = index.memory_usage();
+    index.finalize();
+  }
 
-    if (is_las)
+  if (verbose) post_message("Spatial index: %.1lf MB (%.1lf MB released after indexation)\n", index.memory_usage()/1e6, (memory_build - index.memory_usage())/1e6);
+
+  if (!hnof.empty())
+  {
+    // Not being able to cache the index is not an error. The index is not compressed so it is
+    // used in place from the memory mapped file when it is read again, without decoding.
+    try
     {
-      hnof = hnof.substr(0, hnof.size() - 3);
-      hnof = hnof + "hno";
-      index.write(hnof);
+      index.write(hnof, nullptr, false);
+    }
+    catch (std::exception& e)
+    {
+      if (verbose) post_message("Spatial index not written: %s\n", e.what());
     }
   }
-  else
+
+  // Copy the points in the octree order. Octants are then contiguous ranges of points and the
+  // order of the points is no longer needed.
+  if (reorder)
   {
-    this->index.read(hnof);
-    if (index.get_npoints() != npoints)
-      throw std::runtime_error("Incompatible number of points between the data provided and the octree read from file.");
+    PointCloud copy = points;
+    copy.reorder(index.get_order());
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    points = std::move(copy);
+    index.release_order();
   }
 
   auto end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> duration = end - start;
-  //printf("Indexation: %.1lf seconds (%.1lfM pts/s)\n", duration.count(), x.size()/duration.count()/1000000);
-
-  this->point_budget *= 10;
-  camera.changed = true;
-  draw();
+  if (verbose) post_message("Indexation: %.1lf seconds (%.1lfM pts/s)\n", duration.count(), npoints/duration.count()/1000000);
 }
 
 void Drawer::init_viewport()
@@ -200,8 +449,8 @@ void Drawer::init_viewport()
 
   glViewport(0, 0, width, height);
   glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(fov, (float)width/(float)height, zNear, zFar);
+  camera.setPerspective(fov, (float)width/(float)height, zNear, zFar);
+  glLoadMatrixd(camera.getProjection());
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
@@ -217,58 +466,138 @@ void Drawer::init_viewport()
   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 }
 
-void Drawer::setAttribute(Attribute x)
+// While the index is built in the background the index and the points are shared with the
+// builder thread. The returned lock holds index_mutex in this case only.
+std::unique_lock<std::mutex> Drawer::lock_index()
 {
-  if (x == Attribute::RGB && df.containsElementNamed("R"))
+  std::unique_lock<std::mutex> lock(index_mutex, std::defer_lock);
+  if (indexing)
   {
-    this->attr = x;
-    this->r = df["R"];
-    this->g = df["G"];
-    this->b = df["B"];
-    camera.changed = true;
+    render_waiting = true;
+    lock.lock();
+    render_waiting = false;
+  }
+  return lock;
+}
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, r.size() - 1);
+void Drawer::setAttribute(Attribute x)
+{
+  // The points may be replaced by their reordered copy
+  std::unique_lock<std::mutex> lock = lock_index();
 
-    rgb_norm = 1;
-    for (int i = 0; i < std::min((int)r.size(), 100); ++i)
-    {
-      int index = dis(gen);
-      if (r[index] > 255) rgb_norm = 255;
-    }
+  ColorScale scale = {0, 0, 0, nullptr, 0};
+
+  if (x == Attribute::RGB && points.has_rgb())
+  {
+    // The packed colours are used as is
   }
-  else if (x == Attribute::CLASS && df.containsElementNamed("Classification"))
+  else if (x == Attribute::CLASS && points.has_classification())
   {
-    this->attr = x;
-    this->attri = df["Classification"];
-    camera.changed = true;
+    scale.lut = classlut.data();
+    scale.nlut = classlut.size();
   }
-  else if (x == Attribute::I && df.containsElementNamed("Intensity"))
+  else if (x == Attribute::I && points.has_intensity())
   {
-    this->attr = x;
-    this->attri = df["Intensity"];
     PSquare p99(0.99);
-    for (const auto& i : attri) p99.addDataPoint(i);
-    this->minattr = minz;
-    this->maxattr = p99.getQuantile();
-    this->attrrange = maxattr - minattr;
-    camera.changed = true;
+    size_t qstride = std::max<size_t>(1, points.npoints / 1000000);
+    for (size_t i = 0 ; i < points.npoints ; i += qstride) p99.addDataPoint(points.intensity[i]);
+    scale.min = minz;
+    scale.max = p99.getQuantile();
+    scale.lut = ilut.data();
+    scale.nlut = ilut.size();
   }
   else
   {
-    this->attr = Attribute::Z;
-    this->minattr = zqmin;
-    this->maxattr = zqmax;
-    this->attrrange = maxattr - minattr;
-    camera.changed = true;
+    x = Attribute::Z;
+    scale.min = zqmin;
+    scale.max = zqmax;
+    scale.lut = zlut.data();
+    scale.nlut = zlut.size();
+  }
+
+  if (scale.max > scale.min) scale.factor = (scale.nlut - 1) / (scale.max - scale.min);
+
+  // The colours of this attribute kept in GPU memory are outdated only if the scale changed. The
+  // colours of the other attributes are kept.
+  if (scale != scales[x])
+  {
+    scales[x] = scale;
+    color_generation[x]++;
   }
+
+  this->attr = x;
+  camera.changed = true;
 }
 
 bool Drawer::draw()
 {
+  // Only the changes made by the user count as interactions
+  auto now = std::chrono::high_resolution_clock::now();
+  if (camera.changed) last_interaction = now;
+  bool idle = now - last_interaction > std::chrono::milliseconds(IDLE_DELAY);
+
+  if (index_updated.exchange(false)) camera.changed = true;
+  if (store && store->has_updates()) camera.changed = true;
+
+  if (!indexing && !indexed)
+  {
+    indexed = true;
+    if (builder.joinable()) builder.join();
+    camera.changed = true;
+
+    // The index no longer changes: the visibility queries can run in the background
+    if (index_error.empty())
+    {
+      visibility.reset(new VisibilityQuery(index));
+      last_view.screen_height = -1;
+    }
+    else
+    {
+      post_message("Spatial index not built: %s\n", index_error.c_str());
+    }
+  }
+
+  // A query for a previous view is done. The frame is drawn again with the new visible octants.
+  if (visibility && visibility->update())
+  {
+    visible_octants = visibility->get();
+    camera.changed = true;
+  }
+
+  // The camera stopped but not all the visible points are displayed: refine the frame by
+  // displaying more points at each frame until everything visible is displayed. The budget is
+  // increased only once the octants of the current budget are known, i.e. the frame drawn with
+  // them decided whether there is more to display. The octants of the next budget are queried in
+  // the background and the frame is drawn when they are known, not before with the same octants.
+  bool queried = visible_octants.budget == point_budget;
+  if (idle && !refined && queried && !camera.changed)
+  {
+    point_budget = std::min(budget.get_next(point_budget), idle_max());
+
+    if (visibility)
+    {
+      // The camera did not move since the last frame
+      View view = last_view;
+      view.budget = point_budget;
+      visibility->request(view);
+      last_view = view;
+    }
+    else
+    {
+      camera.changed = true;
+    }
+  }
+
   if (!camera.changed)  return false;
 
+  if (!idle)
+  {
+    point_budget = budget.get();
+    refined = false;
+  }
+
+  std::unique_lock<std::mutex> lock = lock_index();
+
   auto start = std::chrono::high_resolution_clock::now();
 
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);   // Immediate mode. Should be modernized.
@@ -277,60 +606,103 @@ bool Drawer::draw()
   glLineWidth(2.0f);
   glPointSize(this->point_size);
 
-  camera.look(); // Reposition the camera after rotation and translation of the scene;
+  camera.update(); // Reposition the camera after rotation and translation of the scene;
+  glMultMatrixd(camera.getModelview());
 
   auto start_query = std::chrono::high_resolution_clock::now();
 
-  compute_cell_visibility();
+  // The octants drawn are the result of the latest query available. Except for the first one the
+  // render thread never waits for a query: the frame is drawn with the octants visible from a
+  // slightly outdated view and is drawn again when the query of the current view is done. While
+  // the index is built the octants change so the query is done here.
+  View view = {camera, height, fov, xcenter, ycenter, zcenter, point_budget};
+  if (visibility)
+  {
+    if (view != last_view) visibility->request(view);
+    if (visibility->update(true)) visible_octants = visibility->get();
+  }
+  else
+  {
+    query_visible_octants(index, view, visible_octants);
+  }
+  last_view = view;
+
   query_rendered_point();
 
   auto end_query = std::chrono::high_resolution_clock::now();
   auto start_rendering = std::chrono::high_resolution_clock::now();
 
-  glBegin(GL_POINTS);
+  // A resident octant with up to date colours is drawn with a single call. Other batches are
+  // converted into arrays of vertices and colours that are either uploaded in the buffers of the
+  // octant or drawn directly from client memory.
+  bool use_vbo = vbo && vbo->is_available();
+  if (use_vbo) vbo->next_frame();
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
 
-  for (auto i : pp)
+  for (const auto& batch : batches)
   {
-    float px = x[i]-xcenter;
-    float py = y[i]-ycenter;
-    float pz = z[i]-zcenter;
+    bool cached = use_vbo && batch.octant != nullptr;
+    uint64_t key = (cached) ? batch.octant->offset : 0;
+    if (cached && vbo->draw(key, attr, color_generation[attr])) continue;
 
-    switch (attr)
+    bool resident = cached && vbo->contains(key);
+
+    if (!resident)
     {
-      case Attribute::Z:
-      {
-        float nz = (std::clamp(z[i], minattr, maxattr) - minattr) / (attrrange);
-        int bin = std::min(static_cast<int>(nz * (zgradient.size() - 1)), static_cast<int>(zgradient.size() - 1));
-        auto& col = zgradient[bin];
-        glColor3ub(col[0], col[1], col[2]);
-        break;
-      }
-      case Attribute::RGB:
-      {
-        glColor3ub(r[i]/rgb_norm, g[i]/rgb_norm, b[i]/rgb_norm);
-        break;
-      }
-      case Attribute::CLASS:
+      const PointCloud& pc = *batch.points;
+
+      xyz.resize((size_t)batch.count * 3);
+      float* v = xyz.data();
+      if (pc.is_quantized())
       {
-        int classification = std::clamp(attri[i], 0, 19);
-        auto& col = classcolor[classification];
-        glColor3ub(col[0], col[1], col[2]);
-        break;
+        // Integer coordinates relative to the center. The offset of a LAS file may be far from
+        // the points (e.g. 0 with UTM coordinates) so the conversion is done in double precision
+        // and only the small coordinates relative to the center are rounded to float.
+        const double sx = pc.scale[0], sy = pc.scale[1], sz = pc.scale[2];
+        const double ox = pc.offset[0]-xcenter, oy = pc.offset[1]-ycenter, oz = pc.offset[2]-zcenter;
+        for (uint32_t k = batch.start ; k < batch.start + batch.count ; k++)
+        {
+          const int32_t* p = pc.xyz + 3 * (size_t)((batch.order) ? batch.order[k] : k);
+          v[0] = (float)(p[0]*sx + ox);
+          v[1] = (float)(p[1]*sy + oy);
+          v[2] = (float)(p[2]*sz + oz);
+          v += 3;
+        }
       }
-      case Attribute::I:
+      else
       {
-        float ni = (std::clamp(attri[i], (int)minattr, (int)maxattr) - (int)minattr) / (attrrange);
-        int bin = std::min(static_cast<int>(ni * (igradient.size() - 1)), static_cast<int>(igradient.size() - 1));
-        auto& col = igradient[bin];
-        glColor3ub(col[0], col[1], col[2]);
-        break;
+        for (uint32_t k = batch.start ; k < batch.start + batch.count ; k++)
+        {
+          uint32_t i = (batch.order) ? batch.order[k] : k;
+          v[0] = pc.x[i]-xcenter;
+          v[1] = pc.y[i]-ycenter;
+          v[2] = pc.z[i]-zcenter;
+          v += 3;
+        }
       }
     }
 
-    glVertex3d(px, py, pz);
+    rgba.resize(batch.count);
+    colorize(attr, *batch.points, batch.order, batch.start, batch.count, scales[attr], rgba.data());
+
+    if (cached)
+    {
+      vbo->upload(key, attr, color_generation[attr], xyz.data(), rgba.data(), batch.count);
+    }
+    else
+    {
+      glVertexPointer(3, GL_FLOAT, 0, xyz.data());
+      glColorPointer(4, GL_UNSIGNED_BYTE, 0, rgba.data());
+      glDrawArrays(GL_POINTS, 0, batch.count);
+    }
   }
 
-  glEnd();
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  if (use_vbo) vbo->evict();
 
   if (lightning) edl();
 
@@ -338,12 +710,14 @@ bool Drawer::draw()
   {
     glColor3f(1.0f, 1.0f, 1.0f);
 
-    for (const auto& octant : visible_octants)
+    for (const auto& octant : visible_octants.octants)
     {
-      float centerX = octant->bbox[0] - xcenter;
-      float centerY = octant->bbox[1] - ycenter;
-      float centerZ = octant->bbox[2] - zcenter;
-      float halfSize = octant->bbox[3];
+      double bbox[4];
+      index.set_bbox(octant.key, bbox);
+      float centerX = bbox[0] - xcenter;
+      float centerY = bbox[1] - ycenter;
+      float centerZ = bbox[2] - zcenter;
+      float halfSize = bbox[3];
 
       float x0 = centerX - halfSize;
       float x1 = centerX + halfSize;
@@ -399,6 +773,9 @@ bool Drawer::draw()
 
   camera.changed = false;
 
+  // Waits for the GPU so the measured time is the actual cost of the frame
+  glFinish();
+
   auto end_rendering = std::chrono::high_resolution_clock::now();
   auto end = std::chrono::high_resolution_clock::now();
 
@@ -413,85 +790,46 @@ bool Drawer::draw()
   printf("Spatial query: %.3f seconds (%.1f fps %.1f\%)\n", query_duration.count(), 1.0f/query_duration.count(), query_duration.count()/total_duration.count()*100);
   printf("\n");*/
 
-  glFlush();
+  // The budget is adjusted on the interactive frames only. The frames drawn while the index is
+  // built include the waits for the builder thread and are not representative either.
+  if (!indexing && !idle) budget.update(total_duration.count(), rendered_points);
+  // The refinement stops when everything visible is displayed, when the frame reached the largest
+  // budget or when it took longer than the idle target time.
+  if (idle && visible_octants.budget == point_budget)
+    refined = !truncated || point_budget >= idle_max() || total_duration.count() > budget.get_idle_target();
+
   SDL_GL_SwapWindow(window);
 
   return true;
 }
 
-void Drawer::edl()
+// Largest budget of the refined frames. The octants drawn in a frame are never released from the
+// vertex buffers so a frame must fit in their memory budget.
+uint32_t Drawer::idle_max() const
 {
-  std::vector< GLfloat > depth( width * height, 0 );
-  glReadPixels( 0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, &depth[0] );
-
-  std::vector<GLubyte> colorBuffer(width * height * 3);
-  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &colorBuffer[0]);
-
-  const float zNear = 1;
-  const float zFar = 10000;
-  const float logzFar = std::log2(zFar);
-
-  std::vector<GLfloat> worldLogDistances(width * height);
-  for (int i = 0; i < width * height; ++i)
-  {
-    GLfloat z = depth[i];           // Depth value from the depth buffer
-    GLfloat zNDC = 2.0f * z - 1.0f; // Convert depth value to Normalized Device Coordinate (NDC)
-    GLfloat zCamera = (2.0f * zNear * zFar) / (zFar + zNear - zNDC * (zFar - zNear)); // Convert NDC to camera space Z (real-world distance)
-    worldLogDistances[i] = std::log2(zCamera);  // Store the real-world log distance
-  }
-
-  // Define the 8 possible neighbor offsets in a 2D grid
-  /*std::vector<std::pair<int, int>> neighbors = {
-    {-1, -1}, {-1, 0}, {-1, 1},
-    { 0, -1},          { 0, 1},
-    { 1, -1}, { 1, 0}, { 1, 1}
-  };*/
-
-  // Define the 4 possible neighbor offsets in a 2D grid
-  std::vector<std::pair<int, int>> neighbors = {
-             {-1, 0},
-    { 0, -1},         { 0, 1},
-             { 1, 0},
-  };
-
-  // Iterate over each pixel to shade the rendering
-  float edlStrength = 10;
-  for (int y = 0; y < height; ++y)
-  {
-    for (int x = 0; x < width; ++x)
-    {
-      int idx = y * width + x;
-      float wld = worldLogDistances[idx];
-
-      if (wld == logzFar) { continue; }
-
-      // Find the maximum log depth among neighbors
-      GLfloat maxLogDepth = std::max(0.0f, wld);
-
-      // Compute the response for the current pixel
-      GLfloat sum = 0.0f;
-      for (const auto& offset : neighbors)
-      {
-        int nx = x + offset.first;
-        int ny = y + offset.second;
-        if (nx >= 0 && nx < width && ny >= 0 && ny < height)
-        {
-          int nIdx = ny * width + nx;
-          sum += maxLogDepth - worldLogDistances[nIdx];
-        }
-      }
-
-      float response = sum/4;
-      float shade = std::exp(-response * 300.0 * edlStrength);
-      shade = 1-std::clamp(shade, 0.0f, 255.0f)/255.0f;
+  uint64_t n = budget.get_idle_max();
+  if (vbo && vbo->is_available()) n = std::min<uint64_t>(n, vbo->get_budget() / VertexBuffers::BYTES_PER_POINT);
+  return (uint32_t)n;
+}
 
-      colorBuffer[idx * 3] *= shade;
-      colorBuffer[idx * 3 + 1] *= shade;
-      colorBuffer[idx * 3 + 2] *= shade;
-    }
-  }
+// Whether draw() has something to do soon, i.e. whether the event loop must keep calling it or
+// can sleep until the next user event
+bool Drawer::is_pending()
+{
+  if (camera.changed || index_updated || indexing || !indexed) return true;
+  if (!refined) return true;
+  if (store && store->is_loading()) return true;
+  if (visibility && visibility->is_busy()) return true;
+  return false;
+}
 
-  glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, colorBuffer.data());
+void Drawer::edl()
+{
+  shading->resize(width, height);
+  glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, shading->depth());
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, shading->color());
+  shading->shade();
+  glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, shading->color());
 }
 
 void Drawer::resize()
@@ -500,88 +838,74 @@ void Drawer::resize()
 
   glViewport(0, 0, width, height);
   glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(fov, (float)width/(float)height, zNear, zFar);
+  camera.setPerspective(fov, (float)width/(float)height, zNear, zFar);
+  glLoadMatrixd(camera.getProjection());
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
   camera.changed = true;
 }
 
-bool Drawer::is_visible(const Node& octant)
-{
-  return camera.see(octant.bbox[0]-xcenter, octant.bbox[1]-ycenter, octant.bbox[2]-zcenter, octant.bbox[3]);
-}
-
-void Drawer::compute_cell_visibility()
-{
-  visible_octants.clear();
-
-  Key root = Key::root();
-  traverse_and_collect(root, visible_octants);
-
-  std::sort(visible_octants.begin(), visible_octants.end(), [](const Node* a, const Node* b)
-  {
-    return a->screen_size > b->screen_size;  // Sort in descending order
-  });
-}
-
-void Drawer::traverse_and_collect(const Key& key, std::vector<Node*>& visible_octants)
+void Drawer::query_rendered_point()
 {
-  auto it = index.registry.find(key);
-  if (it == index.registry.end()) return;
-
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
-  int screenWidth = viewport[2];
-  int screenHeight = viewport[3];
+  pp.clear();
+  batches.clear();
 
-  float fov = 70*M_PI/180;
-  float slope = std::tan(fov/2.0f);
+  // Once finalized an octant is a range of the octree order. Before that its points are copied
+  // so they can be drawn the same way. Out-of-core, an octant is a point cloud on its own.
+  bool finalized = index.is_finalized();
+  const uint32_t* order = (points.reordered) ? nullptr : index.get_order();
 
-  double cx = camera.x;
-  double cy = camera.y;
-  double cz = camera.z;
+  if (store) store->next_frame();
 
-  Node& octant = it->second;
+  // The query stops at the point budget. Its result may however be the one of a view with a
+  // larger budget.
+  truncated = visible_octants.truncated;
 
-  // Check if the current octant is visible
-  if (is_visible(octant))
+  uint64_t n = 0;
+  for (const auto& octant : visible_octants.octants)
   {
-    // Calculate the screen size or other criteria for visibility
-    float x = octant.bbox[0] - xcenter;
-    float y = octant.bbox[1] - ycenter;
-    float z = octant.bbox[2] - zcenter;
-    float radius = octant.bbox[3] * 2 * 1.414f;
-
-    float distance = std::sqrt((cx - x) * (cx - x) + (cy - y) * (cy - y) + (cz - z) * (cz - z));
-    octant.screen_size = (screenHeight / 2.0f) * (radius / (slope * distance));
-
-    if (octant.screen_size > 200)
+    if (store)
     {
-      visible_octants.push_back(&octant);
-
-      // Recurse into children
-      std::array<Key, 8> children_keys = key.get_children();
-      for (const Key& child_key  : children_keys)
-      {
-        traverse_and_collect(child_key, visible_octants);
-      }
+      // Never waits for the disk. An octant not resident yet is loaded in the background and,
+      // in the meantime, its resident ancestors are displayed alone.
+      const PointCloud* pc = store->request(octant.offset, octant.count);
+      if (pc) batches.push_back({pc, nullptr, 0, (uint32_t)octant.count, &octant});
+    }
+    else if (finalized)
+    {
+      batches.push_back({&points, order, (uint32_t)octant.offset, (uint32_t)octant.count, &octant});
     }
+    else
+    {
+      size_t start = pp.size();
+      batches.push_back({&points, nullptr, (uint32_t)start, (uint32_t)octant.node->point_idx.size(), nullptr});
+      pp.resize(start + octant.node->point_idx.size());
+      octant.node->point_idx.copy(pp.data() + start);
+    }
+
+    n += octant.count;
+    if (n > point_budget) { truncated = true; break; }
   }
-}
 
-void Drawer::query_rendered_point()
-{
-  pp.clear();
+  rendered_points = n;
 
-  unsigned int n = 0;
-  for (const auto octant : visible_octants)
+  // pp is complete and will not be reallocated anymore
+  if (!finalized)
   {
-    n += octant->point_idx.size();
-    pp.insert(pp.end(), octant->point_idx.begin(), octant->point_idx.end());
-    if (n > point_budget) break;
+    for (auto& batch : batches) batch.order = pp.data();
   }
+
+  // Nothing indexed yet: display the strided sample
+  if (batches.empty() && !finalized)
+  {
+    batches.push_back({&points, sample.data(), 0, (uint32_t)sample.size(), nullptr});
+    rendered_points = sample.size();
+  }
+
+  // Octants no longer displayed are released when the memory budget is exceeded. Octants
+  // displayed in this frame are kept.
+  if (store) store->evict();
 }
 
 void Drawer::setPointSize(float size)
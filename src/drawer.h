@@ -4,18 +4,44 @@
 #include <Rcpp.h>
 #include <SDL2/SDL.h>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "BudgetController.h"
+#include "ColorMap.h"
+#include "Edl.h"
+#include "NodeStore.h"
 #include "Octree.h"
+#include "PointCloud.h"
+#include "VertexBuffers.h"
+#include "Visibility.h"
 #include "camera.h"
 
 using namespace Rcpp;
 
-enum Attribute{Z, I, RGB, CLASS};
+// Contiguous range of points to render. The points are the points order[k] of 'points' or the
+// points k if there is no order. If the batch is all the points of an octant of a finalized index, 'octant'
+// is set and the batch can be kept in GPU memory.
+struct Batch
+{
+  const PointCloud* points;
+  const uint32_t* order;
+  uint32_t start;
+  uint32_t count;
+  const VisibleOctant* octant;
+};
 
 class Drawer
 {
 public:
-  Drawer(SDL_Window*, DataFrame, std::string hnof);
+  Drawer(SDL_Window*, DataFrame, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory);
+  ~Drawer();
   bool draw();
+  bool is_pending();
   void resize();
   void setPointSize(float);
   void setAttribute(Attribute x);
@@ -23,8 +49,8 @@ public:
   void display_hide_edl() { lightning = !lightning; camera.changed = true; };
   void point_size_plus() { point_size++; camera.changed = true; };
   void point_size_minus() { point_size--; camera.changed = true; };
-  void budget_plus() { point_budget += 500000; camera.changed = true; };
-  void budget_minus() { if (point_budget > 500000) point_budget -= 500000; camera.changed = true; };
+  void budget_plus() { budget.set_fps(budget.get_fps() - 5); camera.changed = true; };
+  void budget_minus() { budget.set_fps(budget.get_fps() + 5); camera.changed = true; };
   Camera camera;
   Octree index;
 
@@ -33,16 +59,26 @@ public:
 
 private:
   void edl();
-  bool is_visible(const Node& octant);
-  void compute_cell_visibility();
   void query_rendered_point();
-  void traverse_and_collect(const Key& key, std::vector<Node*>& visible_octants);
   void init_viewport();
+  void build_index_task(std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose);
+  void build_index(const std::string& hnof, int ncpu, bool sorted, bool reorder, bool verbose);
+  std::unique_lock<std::mutex> lock_index();
+  uint32_t idle_max() const;
+  bool read_index(const std::string& hnof, bool reorder, bool verbose);
 
   bool draw_index;
-  uint32_t npoints;
-  int point_budget;
-  int rgb_norm;
+  uint64_t npoints;
+  uint64_t fingerprint;
+  uint32_t point_budget;
+
+  // The point budget follows the frame time. The camera is idle when it has not moved for a
+  // while and the frame is then refined until all the visible points are displayed.
+  BudgetController budget;
+  std::chrono::high_resolution_clock::time_point last_interaction;
+  bool refined;
+  bool truncated; // the last query was stopped by the point budget
+  uint64_t rendered_points;
 
   double minx;
   double miny;
@@ -59,24 +95,43 @@ private:
   double range;
   double zqmin;
   double zqmax;
-  double minattr;
-  double maxattr;
-  double attrrange;
 
-  DataFrame df;
+  // Colouring of each attribute. The generation of an attribute changes with its scale.
+  ColorScale scales[NATTRIBUTES];
+  uint32_t color_generation[NATTRIBUTES];
+  std::vector<uint32_t> zlut;
+  std::vector<uint32_t> ilut;
+  std::vector<uint32_t> classlut;
+
+  // Only the coordinates of the data.frame are used in place. The attributes are packed copies.
   NumericVector x;
   NumericVector y;
   NumericVector z;
-  IntegerVector r;
-  IntegerVector g;
-  IntegerVector b;
 
-  IntegerVector attri;
-  NumericVector attrd;
+  // Out-of-core the points are in the store and 'points' only holds the root octant
+  PointCloud points;
+  std::unique_ptr<NodeStore> store;
 
   Attribute attr;
-  std::vector<int> pp;
-  std::vector<Node*> visible_octants;
+  std::vector<uint32_t> pp;
+  std::vector<uint32_t> sample;
+  std::vector<Batch> batches;
+  std::unique_ptr<VertexBuffers> vbo;
+  std::unique_ptr<Edl> shading;
+  std::vector<float> xyz;
+  std::vector<uint32_t> rgba;
+  VisibleOctants visible_octants;
+  std::unique_ptr<VisibilityQuery> visibility;
+  View last_view;
+
+  std::thread builder;
+  std::mutex index_mutex;
+  std::atomic<bool> indexing;
+  std::atomic<bool> index_updated;
+  std::atomic<bool> render_waiting;
+  std::atomic<bool> cancel;
+  std::string index_error; // set by the builder thread if the indexation failed
+  bool indexed;
 
   SDL_Window *window;
   float zNear;
@@ -3,8 +3,22 @@
 #include <SDL2/SDL.h>
 
 #include <thread>
+#include <algorithm>
 #include <atomic>
-
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "BitPacking.h"
+#include "Edl.h"
+#include "ExternalBuilder.h"
+#include "LasReader.h"
+#include "Messages.h"
+#include "camera.h"
 #include "drawer.h"
 #include "sdlglutils.h"
 
@@ -95,10 +109,14 @@ const char *move[] =
 
 
 const Uint32 time_per_frame = 1000 / 30;
+const Uint32 idle_wait = 100; // ms, wakes up regularly to detect the end of the background tasks
 bool running = false;
 std::thread sdl_thread;
 
-void sdl_loop(DataFrame df, std::string hnof)
+// When detached the loop runs on its own thread and the messages are printed by the next call
+// from R on the main thread. Throws if the window or the drawer cannot be created, once SDL is
+// shut down.
+void sdl_loop(DataFrame df, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory, bool detached)
 {
   SDL_Event event;
 
@@ -110,7 +128,7 @@ void sdl_loop(DataFrame df, std::string hnof)
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0)
   {
-    Rcpp::stop("Unable to initialize SDL: %s", SDL_GetError());
+    throw std::runtime_error(std::string("Unable to initialize SDL: ") + SDL_GetError());
   }
 
   SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
@@ -119,7 +137,7 @@ void sdl_loop(DataFrame df, std::string hnof)
   if (window == nullptr)
   {
     SDL_Quit();
-    Rcpp::stop("Unable to create SDL window: %s", SDL_GetError());
+    throw std::runtime_error(std::string("Unable to create SDL window: ") + SDL_GetError());
   }
 
   SDL_GLContext glContext = SDL_GL_CreateContext(window);
@@ -130,7 +148,30 @@ void sdl_loop(DataFrame df, std::string hnof)
   SDL_Cursor* _move  = cursorFromXPM(move);
   SDL_SetCursor(_hand1);
 
-  Drawer *drawer = new Drawer(window, df, hnof);
+  auto close = [&]()
+  {
+    SDL_SetCursor(NULL);
+    SDL_FreeCursor(_hand1);
+    SDL_FreeCursor(_hand2);
+    SDL_FreeCursor(_move);
+    SDL_GL_DeleteContext(glContext);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    running = false;
+  };
+
+  // The file may be invalid, the point cloud too large or the memory insufficient
+  Drawer *drawer = nullptr;
+  try
+  {
+    drawer = new Drawer(window, df, hnof, ncpu, sorted, reorder, verbose, memory);
+  }
+  catch (...)
+  {
+    close();
+    throw;
+  }
+
   drawer->camera.setRotateSensivity(0.1);
   drawer->camera.setZoomSensivity(10);
   drawer->camera.setPanSensivity(1);
@@ -144,7 +185,16 @@ void sdl_loop(DataFrame df, std::string hnof)
 
   while (run)
   {
-    while (SDL_PollEvent(&event))
+    if (!detached) flush_messages();
+
+    // Sleeps until the next event unless the drawer has something to do. In this case the event
+    // loop runs at the frame rate.
+    current_time = SDL_GetTicks();
+    elapsed_time = current_time - last_time;
+    int timeout = (!drawer->is_pending()) ? idle_wait : (elapsed_time < time_per_frame) ? time_per_frame - elapsed_time : 0;
+
+    bool has_event = SDL_WaitEventTimeout(&event, timeout);
+    while (has_event)
     {
       switch (event.type)
       {
@@ -265,20 +315,18 @@ void sdl_loop(DataFrame df, std::string hnof)
           break;
         }
       }
+
+      has_event = SDL_PollEvent(&event);
     }
 
     current_time = SDL_GetTicks();
     elapsed_time = current_time - last_time;
 
-    if (elapsed_time > time_per_frame)
+    if (elapsed_time >= time_per_frame)
     {
       drawer->draw();
       last_time = current_time;
     }
-    else
-    {
-      SDL_Delay(time_per_frame - elapsed_time);
-    }
   }
 
   current_time = SDL_GetTicks();
@@ -295,28 +343,452 @@ void sdl_loop(DataFrame df, std::string hnof)
   }
 
   delete drawer;
-  SDL_SetCursor(NULL);
-  SDL_FreeCursor(_hand1);
-  SDL_FreeCursor(_hand2);
-  SDL_FreeCursor(_move);
-  SDL_GL_DeleteContext(glContext);
-  SDL_DestroyWindow(window);
-  SDL_Quit();
-  running = false;
+  close();
+}
+
+// Entry point of the thread of a detached viewer. An exception must not escape the thread.
+void sdl_loop_detached(DataFrame df, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory)
+{
+  try
+  {
+    sdl_loop(df, hnof, ncpu, sorted, reorder, verbose, memory, true);
+  }
+  catch (std::exception& e)
+  {
+    post_message("Error in the viewer: %s\n", e.what());
+    running = false;
+  }
+}
+
+// Checks that a file given in place of a point cloud can be displayed before any window is
+// created: the errors are then reported to R as regular errors. A LAS file is read natively. Any
+// other file must be a HNOF file that contains the points, not only their index.
+void check_file(const std::string& file, bool is_las)
+{
+  if (is_las)
+  {
+    LasReader las(file);
+    if (las.get_npoints() > UINT32_MAX)
+      throw std::runtime_error("Spatial indexation is bound to 4,294 billion points");
+  }
+  else
+  {
+    if (!std::ifstream(file))
+      throw std::runtime_error("Failed to open file for reading: " + file);
+
+    Octree index;
+    if (!index.read(file))
+      throw std::runtime_error("Failed to read the file: " + file);
+    if (!index.has_data())
+      throw std::runtime_error("The file does not contain the points and cannot be displayed without the point cloud: " + file);
+  }
 }
 
 // [[Rcpp::export]]
-void viewer(DataFrame df, bool detach, std::string hnof)
+void viewer(DataFrame df, bool detach, std::string hnof, int ncpu, bool sorted, bool reorder, bool verbose, double memory)
 {
+  // Messages left by a previous detached viewer
+  flush_messages();
+
+  // A file is displayed in place of a point cloud if the data.frame is empty
+  auto is_las = [](std::string file)
+  {
+    std::transform(file.begin(), file.end(), file.begin(), [](unsigned char c) { return std::tolower(c); });
+    return file.size() >= 4 && (file.compare(file.size() - 4, 4, ".las") == 0 || file.compare(file.size() - 4, 4, ".laz") == 0);
+  };
+
+  if (df.size() == 0)
+  {
+    try
+    {
+      check_file(hnof, is_las(hnof));
+    }
+    catch (std::exception& e)
+    {
+      Rcpp::stop(e.what());
+    }
+  }
+
   if (detach)
   {
     if (running) Rcpp::stop("lidRviewer is limited to one rendering point cloud");
-    sdl_thread = std::thread(sdl_loop, df, hnof);
-    sdl_thread.detach();  // Detach the thread to allow it to run independently
     running = true;
+    sdl_thread = std::thread(sdl_loop_detached, df, hnof, ncpu, sorted, reorder, verbose, memory);
+    sdl_thread.detach();  // Detach the thread to allow it to run independently
   }
   else
   {
-    sdl_loop(df, hnof);
+    sdl_loop(df, hnof, ncpu, sorted, reorder, verbose, memory, false);
+    flush_messages();
+  }
+}
+
+// [[Rcpp::export]]
+std::string hnof_fingerprint(DataFrame df)
+{
+  NumericVector x = df["X"];
+  NumericVector y = df["Y"];
+  NumericVector z = df["Z"];
+
+  PointCloud points;
+  points.npoints = x.length();
+  points.x = &x[0];
+  points.y = &y[0];
+  points.z = &z[0];
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)points.fingerprint());
+  return std::string(hex);
+}
+
+// [[Rcpp::export]]
+void hnof_write(DataFrame df, std::string file, int ncpu, bool compress)
+{
+  NumericVector x = df["X"];
+  NumericVector y = df["Y"];
+  NumericVector z = df["Z"];
+
+  PointCloud points;
+  points.npoints = x.length();
+  points.x = &x[0];
+  points.y = &y[0];
+  points.z = &z[0];
+
+  if (df.containsElementNamed("R") && df.containsElementNamed("G") && df.containsElementNamed("B"))
+  {
+    IntegerVector r = df["R"];
+    IntegerVector g = df["G"];
+    IntegerVector b = df["B"];
+    points.set_rgb(&r[0], &g[0], &b[0]);
+  }
+
+  if (df.containsElementNamed("Intensity"))
+  {
+    IntegerVector intensity = df["Intensity"];
+    points.set_intensity(&intensity[0]);
+  }
+
+  if (df.containsElementNamed("Classification"))
+  {
+    IntegerVector classification = df["Classification"];
+    points.set_classification(&classification[0]);
+  }
+
+  Octree index(&x[0], &y[0], &z[0], x.length());
+  index.set_fingerprint(points.fingerprint());
+  index.build(ncpu);
+  index.write(file, &points, compress);
+}
+
+// Indexes a LAS file that may not fit in memory
+// [[Rcpp::export]]
+void hnof_write_las(std::string las, std::string file, double memory, std::string tmpdir, bool verbose)
+{
+  ExternalBuilder builder(las, tmpdir, memory, verbose);
+  builder.write(file);
+  flush_messages();
+}
+
+// Size and decoding speed of the compressed index of a point cloud vs. the raw index
+// [[Rcpp::export]]
+List hnof_benchmark(DataFrame df, int ncpu, int times = 10)
+{
+  NumericVector x = df["X"];
+  NumericVector y = df["Y"];
+  NumericVector z = df["Z"];
+
+  Octree index(&x[0], &y[0], &z[0], x.length());
+  index.build(ncpu);
+  index.finalize();
+
+  const uint32_t* order = index.get_order();
+  size_t n = index.get_npoints();
+
+  std::vector<std::pair<uint32_t, uint32_t>> nodes;
+  for (const auto& node : index.get_hierarchy()) nodes.emplace_back(node.offset, node.count);
+
+  std::vector<uint64_t> streams_offset;
+  std::vector<uint8_t> streams;
+  for (const auto& node : nodes)
+  {
+    streams_offset.push_back(streams.size());
+    bitpack_encode(order + node.first, node.second, streams);
+  }
+  streams_offset.push_back(streams.size());
+  size_t compressed_size = streams_offset.size() * sizeof(uint64_t) + streams.size();
+  streams.resize(streams.size() + BITPACK_PADDING, 0);
+
+  std::vector<uint32_t> out(n);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int k = 0 ; k < times ; k++)
+  {
+    for (size_t i = 0 ; i < nodes.size() ; i++)
+      bitpack_decode(&streams[streams_offset[i]], streams_offset[i+1] - streams_offset[i], nodes[i].second, &out[nodes[i].first]);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> decode = end - start;
+
+  bool identical = std::equal(out.begin(), out.end(), order);
+
+  start = std::chrono::high_resolution_clock::now();
+  for (int k = 0 ; k < times ; k++) std::copy(order, order + n, out.begin());
+  end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> copy = end - start;
+
+  return List::create(
+    _["npoints"] = (double)n,
+    _["raw_bytes_per_point"] = (double)sizeof(uint32_t),
+    _["compressed_bytes_per_point"] = (double)compressed_size / n,
+    _["decode_mpts_per_second"] = n * times / decode.count() / 1e6,
+    _["copy_mpts_per_second"] = n * times / copy.count() / 1e6,
+    _["lossless"] = identical);
+}
+
+// Hash of the keys of the std::unordered_map previously used as registry (PDAL hash method)
+struct KeyHasher
+{
+  size_t operator()(const Key &k) const
+  {
+    std::hash<size_t> h;
+    size_t k1 = ((size_t)k.d << 32) | k.x;
+    size_t k2 = ((size_t)k.y << 32) | k.z;
+    return h(k1) ^ (h(k2) << 1);
+  }
+};
+
+// Throughput of the registry vs. std::unordered_map on the lookups of the sequential build of the
+// index of a point cloud: each point is looked up from the root down to the level of its octant.
+// The first pass creates the nodes, the next ones only find them.
+// [[Rcpp::export]]
+List registry_benchmark(DataFrame df, int ncpu, int times = 10)
+{
+  NumericVector x = df["X"];
+  NumericVector y = df["Y"];
+  NumericVector z = df["Z"];
+
+  Octree index(&x[0], &y[0], &z[0], x.length());
+  auto start = std::chrono::high_resolution_clock::now();
+  index.build(ncpu);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> build = end - start;
+  index.finalize();
+
+  // Level of the octant of each point
+  size_t n = index.get_npoints();
+  const uint32_t* order = index.get_order();
+  std::vector<uint8_t> level(n);
+  for (const auto& node : index.get_hierarchy())
+  {
+    for (uint64_t k = 0 ; k < node.count ; k++)
+      level[order[node.offset + k]] = node.key.d;
+  }
+
+  uint64_t lookups = 0;
+  for (size_t i = 0 ; i < n ; i++) lookups += level[i] + 1;
+
+  auto run = [&](auto& map)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int k = 0 ; k < times ; k++)
+    {
+      for (size_t i = 0 ; i < n ; i++)
+      {
+        for (int lvl = 0 ; lvl <= level[i] ; lvl++)
+        {
+          Key key = index.get_key(x[i], y[i], z[i], lvl);
+          auto it = map.find(key);
+          if (it == map.end()) it = map.emplace(key, Node()).first;
+          it->second.count++;
+        }
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+  };
+
+  std::unordered_map<Key, Node, KeyHasher> map;
+  double map_time = run(map);
+
+  Registry registry;
+  double registry_time = run(registry);
+
+  size_t nnodes = index.get_hierarchy().size();
+  bool identical = map.size() == nnodes && registry.size() == nnodes;
+  for (const auto& pair : registry)
+  {
+    auto it = map.find(pair.first);
+    identical = identical && it != map.end() && it->second.count == pair.second.count;
+  }
+
+  return List::create(
+    _["npoints"] = (double)n,
+    _["nnodes"] = (double)registry.size(),
+    _["build_seconds"] = build.count(),
+    _["lookups_per_point"] = (double)lookups / n,
+    _["unordered_map_mlookups_per_second"] = lookups * times / map_time / 1e6,
+    _["registry_mlookups_per_second"] = lookups * times / registry_time / 1e6,
+    _["identical"] = identical);
+}
+
+// Eye-dome lighting of a synthetic frame vs. the reference implementation
+// [[Rcpp::export]]
+List edl_benchmark(int width = 1920, int height = 1080, int ncpu = 1, int times = 10)
+{
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> unif(0, 1);
+  std::uniform_int_distribution<int> color(0, 255);
+
+  // A wavy surface sparsely covered by points in front of the background (depth = 1)
+  const float zNear = 1;
+  const float zFar = 10000;
+  std::vector<float> depth((size_t)width * height);
+  std::vector<uint8_t> rgb((size_t)width * height * 3);
+  for (int y = 0 ; y < height ; y++)
+  {
+    for (int x = 0 ; x < width ; x++)
+    {
+      size_t i = (size_t)y * width + x;
+      depth[i] = 1.0f;
+      if (unif(gen) < 0.6f)
+      {
+        float d = 50 + 20 * std::sin(x * 0.01f) + 10 * std::cos(y * 0.013f) + 2 * unif(gen);
+        float ndc = (zFar + zNear - 2 * zNear * zFar / d) / (zFar - zNear);
+        depth[i] = (ndc + 1) / 2;
+      }
+    }
+  }
+  for (auto& c : rgb) c = color(gen);
+
+  std::vector<uint8_t> expected(rgb);
+  auto start = std::chrono::high_resolution_clock::now();
+  Edl::shade_reference(depth.data(), expected.data(), width, height);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> reference = end - start;
+
+  Edl edl(ncpu);
+  edl.resize(width, height);
+  std::chrono::duration<double> elapsed(0);
+  for (int k = 0 ; k < times ; k++)
+  {
+    std::copy(depth.begin(), depth.end(), edl.depth());
+    std::copy(rgb.begin(), rgb.end(), edl.color());
+    start = std::chrono::high_resolution_clock::now();
+    edl.shade();
+    end = std::chrono::high_resolution_clock::now();
+    elapsed += end - start;
+  }
+
+  int max_difference = 0;
+  double differing = 0;
+  for (size_t i = 0 ; i < rgb.size() ; i++)
+  {
+    int diff = std::abs((int)expected[i] - (int)edl.color()[i]);
+    if (diff > 0) differing++;
+    max_difference = std::max(max_difference, diff);
+  }
+
+  return List::create(
+    _["reference_ms"] = reference.count() * 1000,
+    _["edl_ms"] = elapsed.count() * 1000 / times,
+    _["differing_channels"] = differing,
+    _["max_difference"] = max_difference);
+}
+
+// Matrices and frustum of the camera for random views vs. the reference implementations
+// [[Rcpp::export]]
+List camera_benchmark(int views = 1000, int times = 10)
+{
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> unif(0, 1);
+
+  const double zNear = 1;
+  const double zFar = 100000;
+
+  double modelview_error = 0;
+  double projection_error = 0;
+  double position_error = 0;
+  double differing_children = 0;
+  std::chrono::duration<double> elapsed(0);
+
+  for (int i = 0 ; i < views ; i++)
+  {
+    Camera camera;
+    camera.angleY = -90 + 180 * unif(gen);
+    camera.angleZ = -180 + 360 * unif(gen);
+    camera.distance = 1 + 1000 * unif(gen);
+    camera.setDeltaXYZ(-100 + 200 * unif(gen), -100 + 200 * unif(gen), 0);
+    double fov = 30 + 60 * unif(gen);
+    double aspect = 0.5 + 1.5 * unif(gen);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int k = 0 ; k < times ; k++)
+    {
+      camera.setPerspective(fov, aspect, zNear, zFar);
+      camera.update();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    elapsed += end - start;
+
+    const double* m = camera.getModelview();
+    const double* pr = camera.getProjection();
+    double scale = camera.distance + 500;
+
+    for (int j = 0 ; j < 10 ; j++)
+    {
+      // A point of the scene. The errors are relative to the distance of the scene to the camera.
+      double p[3] = {-500 + 1000 * unif(gen), -500 + 1000 * unif(gen), -500 + 1000 * unif(gen)};
+      double expected[3];
+      Camera::modelview_reference(camera, p, expected);
+      for (int r = 0 ; r < 3 ; r++)
+      {
+        double q = m[r] * p[0] + m[4+r] * p[1] + m[8+r] * p[2] + m[12+r];
+        modelview_error = std::max(modelview_error, std::abs(q - expected[r]) / scale);
+      }
+
+      // Normalized device coordinates of a point in the frustum
+      double d = zNear + (zFar - zNear) * unif(gen);
+      double t = std::tan(fov * M_PI / 360);
+      double q[3] = {(-1 + 2 * unif(gen)) * d * t * aspect, (-1 + 2 * unif(gen)) * d * t, -d};
+      double ndc[3];
+      Camera::projection_reference(fov, aspect, zNear, zFar, q, ndc);
+      double w = pr[3] * q[0] + pr[7] * q[1] + pr[11] * q[2] + pr[15];
+      for (int r = 0 ; r < 3 ; r++)
+      {
+        double c = pr[r] * q[0] + pr[4+r] * q[1] + pr[8+r] * q[2] + pr[12+r];
+        projection_error = std::max(projection_error, std::abs(c / w - ndc[r]));
+      }
+    }
+
+    // The camera is at the origin of the camera space
+    double eye[3] = {camera.x, camera.y, camera.z};
+    double origin[3];
+    Camera::modelview_reference(camera, eye, origin);
+    position_error = std::max(position_error, std::sqrt(origin[0]*origin[0] + origin[1]*origin[1] + origin[2]*origin[2]) / scale);
+
+    // The 8 children of octants around the target vs. one test per child
+    const CFrustum& frustum = camera.getFrustum();
+    for (int j = 0 ; j < 10 ; j++)
+    {
+      float x = -500 + 1000 * unif(gen);
+      float y = -500 + 1000 * unif(gen);
+      float z = -500 + 1000 * unif(gen);
+      float size = 1 + 100 * unif(gen);
+      unsigned char children_planes[8];
+      unsigned char visible = frustum.ChildrenInFrustum(x, y, z, size, CFrustum::ALL_PLANES, children_planes);
+      for (int k = 0 ; k < 8 ; k++)
+      {
+        unsigned char planes = CFrustum::ALL_PLANES;
+        bool inside = frustum.CubeInFrustum((k & 1) ? x + size : x - size, (k & 2) ? y + size : y - size, (k & 4) ? z + size : z - size, size, planes);
+        if (inside != ((visible >> k) & 1)) differing_children++;
+      }
+    }
   }
+
+  return List::create(
+    _["update_us"] = elapsed.count() * 1e6 / ((double)views * times),
+    _["modelview_error"] = modelview_error,
+    _["projection_error"] = projection_error,
+    _["position_error"] = position_error,
+    _["differing_children"] = differing_children);
 }